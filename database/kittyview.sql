@@ -41,6 +41,12 @@
 -- SQL Statements to prepare the database for data upload and generate
 -- a view that will attach useable timestamps to the logged data
 
+-- kittyfiler applies these same statements itself at startup as
+-- versioned migrations (see kittyfiler/src/schema.cpp), recording
+-- them in kittyfiler.schema_version. Keep the two in step.
+
+create schema if not exists kittyfiler;
+
 -- Create the main logging table and add required columns
 create table if not exists kittyfiler.ammonia
   (
@@ -52,30 +58,329 @@ create table if not exists kittyfiler.ammonia
     readtime timestamptz
   );
 
--- Build view that estimates time stamp from the microcontroller's
--- Millis readings
-CREATE OR REPLACE VIEW kittyfiler.kittyview as
-select sq1.LID, sq1.timemillis, sq1.value, sq1.warmedup,
-       to_timestamp(sq1.timemillis *
-		    regr_slope(
-		      sq1.readtime_epoch,
-		      sq1.sentmillis) over w1 +
-		      regr_intercept(
-			sq1.readtime_epoch,
-			sq1.sentmillis) over w1)
-	 as esttime
+-- Each row records which serial device it was read from
+alter table kittyfiler.ammonia add column if not exists device text;
+
+-- Each sample's time, estimated by kittyfiler from the device's
+-- millis() as it is inserted
+alter table kittyfiler.ammonia add column if not exists esttime timestamptz;
+
+-- Rows stored before esttime was kept get it from the regression the
+-- view used to run on every query. Device resets are found
+-- separately for each device
+update kittyfiler.ammonia a
+   set esttime = e.esttime
   from (
-    select LID, sentmillis, timemillis, value, warmedup, readtime,
-	   sum(startpart)
-	     over (order by LID rows between unbounded preceding and current row)
-	     as timegroups,
-	   extract(epoch from readtime) as readtime_epoch
+    select sq1.LID,
+	   to_timestamp(sq1.timemillis *
+			regr_slope(
+			  sq1.readtime_epoch,
+			  sq1.sentmillis) over w1 +
+			  regr_intercept(
+			    sq1.readtime_epoch,
+			    sq1.sentmillis) over w1)
+	     as esttime
       from (
-	select LID, sentmillis, timemillis, value, warmedup, readtime,
-	       case when lag(sentmillis::int, 1, 0) over (order by LID ASC)
-			> sentmillis then 1 else 0
-	       end::integer as startpart
-	  from kittyfiler.ammonia) d1
-     order by LID) sq1
-	 window w1 as (partition by sq1.timegroups)
- order by sq1.LID;
+	select LID, sentmillis, timemillis, readtime, device,
+	       sum(startpart)
+		 over (partition by device order by LID
+		       rows between unbounded preceding and current row)
+		 as timegroups,
+	       extract(epoch from readtime) as readtime_epoch
+	  from (
+	    select LID, sentmillis, timemillis, readtime, device,
+		   case when lag(sentmillis, 1, 0::bigint)
+			       over (partition by device order by LID ASC)
+			    > sentmillis then 1 else 0
+		   end::integer as startpart
+	      from kittyfiler.ammonia) d1) sq1
+	     window w1 as (partition by sq1.device, sq1.timegroups)) e
+ where a.LID = e.LID and a.esttime is null;
+
+create index if not exists ammonia_device_esttime
+  on kittyfiler.ammonia (device, esttime);
+
+-- Monthly partitions of parent on col, from the month holding since
+-- to the one holding now() + ahead, in UTC. Rows of a new month
+-- already in the default partition are moved into it. Partitions are
+-- named <parent>_p<YYYYMM> and <parent>_pdefault
+create or replace function kittyfiler.ensure_partitions
+  (parent regclass, col text, since timestamptz, ahead interval)
+  returns integer language plpgsql as $$
+declare
+  nsp text;
+  rel text;
+  part text;
+  existing regclass;
+  m timestamp;
+  lo timestamptz;
+  hi timestamptz;
+  made integer := 0;
+begin
+  select n.nspname, c.relname into nsp, rel
+    from pg_class c join pg_namespace n on n.oid = c.relnamespace
+   where c.oid = parent;
+
+  if to_regclass(format('%I.%I', nsp, rel || '_pdefault')) is null then
+    execute format('create table %I.%I partition of %s default',
+		   nsp, rel || '_pdefault', parent);
+  end if;
+
+  for m in select generate_series(
+		    date_trunc('month', coalesce(since, now()) at time zone 'UTC'),
+		    date_trunc('month', (now() + ahead) at time zone 'UTC'),
+		    interval '1 month')
+  loop
+    part := rel || '_p' || to_char(m, 'YYYYMM');
+    existing := to_regclass(format('%I.%I', nsp, part));
+
+    if existing is not null then
+      -- A table of that name belonging to something else must not be
+      -- mistaken for this month's partition
+      if not exists (select 1 from pg_inherits
+		      where inhrelid = existing and inhparent = parent) then
+	raise exception '% exists but is not a partition of %',
+	  existing, parent;
+      end if;
+      continue;
+    end if;
+
+    lo := m at time zone 'UTC';
+    hi := (m + interval '1 month') at time zone 'UTC';
+    execute format('create table %I.%I (like %s including defaults)',
+		   nsp, part, parent);
+    execute format('with moved as (delete from %I.%I where %I >= %L and %I < %L '
+		   'returning *) insert into %I.%I select * from moved',
+		   nsp, rel || '_pdefault', col, lo, col, hi, nsp, part);
+    execute format('alter table %s attach partition %I.%I '
+		   'for values from (%L) to (%L)', parent, nsp, part, lo, hi);
+    made := made + 1;
+  end loop;
+
+  return made;
+end
+$$;
+
+-- Drop every partition of parent whose range ended more than keep
+-- ago, instead of deleting its rows one by one
+create or replace function kittyfiler.drop_partitions
+  (parent regclass, keep interval)
+  returns integer language plpgsql as $$
+declare
+  part regclass;
+  hi timestamptz;
+  dropped integer := 0;
+begin
+  for part, hi in
+    select c.oid::regclass,
+	   (regexp_match(pg_get_expr(c.relpartbound, c.oid),
+			 'TO \(''([^'']+)''\)'))[1]::timestamptz
+      from pg_inherits i join pg_class c on c.oid = i.inhrelid
+     where i.inhparent = parent
+  loop
+    continue when hi is null or hi > now() - keep;
+    execute format('drop table %s', part);
+    dropped := dropped + 1;
+  end loop;
+
+  return dropped;
+end
+$$;
+
+-- Rebuild the table partitioned by month on readtime, which
+-- kittyfiler always sets, keeping LID numbering where it was. Only a
+-- plain table is rebuilt, so running this again changes nothing, and
+-- the old table is only dropped once every row has been copied
+do $$
+declare
+  copied bigint;
+  kept bigint;
+begin
+  if (select relkind from pg_class
+       where oid = 'kittyfiler.ammonia'::regclass) = 'p' then
+    return;
+  end if;
+
+  alter table kittyfiler.ammonia rename to ammonia_flat;
+
+  create table kittyfiler.ammonia
+    (
+      LID integer not null default nextval('kittyfiler.ammonia_lid_seq'),
+      sentmillis bigint,
+      timemillis bigint,
+      value numeric,
+      warmedup bool,
+      readtime timestamptz,
+      device text,
+      esttime timestamptz
+    ) partition by range (readtime);
+
+  alter sequence kittyfiler.ammonia_lid_seq owned by kittyfiler.ammonia.LID;
+
+  -- Rows arrive in time order, so a few pages of BRIN summary stand
+  -- in for a btree over every row
+  create index ammonia_readtime on kittyfiler.ammonia using brin (readtime);
+  create index ammonia_esttime on kittyfiler.ammonia using brin (esttime);
+
+  perform kittyfiler.ensure_partitions
+    ('kittyfiler.ammonia', 'readtime',
+     (select min(readtime) from kittyfiler.ammonia_flat),
+     interval '3 months');
+
+  insert into kittyfiler.ammonia
+    (LID, sentmillis, timemillis, value, warmedup, readtime, device,
+     esttime)
+  select LID, sentmillis, timemillis, value, warmedup, readtime, device,
+	 esttime
+    from kittyfiler.ammonia_flat;
+
+  -- The view still points at the old table until it is replaced
+  CREATE OR REPLACE VIEW kittyfiler.kittyview as
+  select LID, timemillis, value, warmedup, esttime, device, readtime
+    from kittyfiler.ammonia;
+
+  select count(*) into kept from kittyfiler.ammonia_flat;
+  select count(*) into copied from kittyfiler.ammonia;
+  if copied <> kept then
+    raise exception 'Partitioned kittyfiler.ammonia has % rows, not %',
+      copied, kept;
+  end if;
+
+  drop table kittyfiler.ammonia_flat;
+end
+$$;
+
+-- The view attaches useable time stamps to the logged data. Filter
+-- on readtime too so only the partitions needed are read
+CREATE OR REPLACE VIEW kittyfiler.kittyview as
+select LID, timemillis, value, warmedup, esttime, device, readtime
+  from kittyfiler.ammonia;
+
+-- Per device summaries of each minute and hour for charting long
+-- stretches of time. kittyfiler adds to them as samples arrive
+create table if not exists kittyfiler.ammonia_1m
+  (
+    device text not null,
+    bucket timestamptz not null,
+    min double precision,
+    max double precision,
+    sum double precision,
+    count bigint,
+    mean double precision generated always as (sum / nullif(count, 0)) stored,
+    last double precision,
+    lasttime timestamptz,
+    primary key (device, bucket)
+  );
+
+create table if not exists kittyfiler.ammonia_1h
+  (
+    device text not null,
+    bucket timestamptz not null,
+    min double precision,
+    max double precision,
+    sum double precision,
+    count bigint,
+    mean double precision generated always as (sum / nullif(count, 0)) stored,
+    last double precision,
+    lasttime timestamptz,
+    primary key (device, bucket)
+  );
+
+-- Fill both from the samples already stored. Buckets are counted
+-- from the epoch, as kittyfiler does, whatever the time zone
+insert into kittyfiler.ammonia_1m
+  (device, bucket, min, max, sum, count, last, lasttime)
+select device, to_timestamp(floor(extract(epoch from t) / 60) * 60),
+       min(value), max(value), sum(value), count(*),
+       (array_agg(value order by t desc))[1], max(t)
+  from (select device, value, coalesce(esttime, readtime) as t
+	  from kittyfiler.ammonia) s
+ where t is not null
+ group by 1, 2
+    on conflict do nothing;
+
+insert into kittyfiler.ammonia_1h
+  (device, bucket, min, max, sum, count, last, lasttime)
+select device, to_timestamp(floor(extract(epoch from bucket) / 3600) * 3600),
+       min(min), max(max), sum(sum), sum(count),
+       (array_agg(last order by lasttime desc))[1], max(lasttime)
+  from kittyfiler.ammonia_1m
+ group by 1, 2
+    on conflict do nothing;
+
+-- Samples as the sketch sends them, for kittyfiler -K. The raw ADC
+-- reading is a smallint and times are microseconds since the epoch,
+-- widest columns first so no row carries alignment padding
+create table if not exists kittyfiler.ammonia_compact
+  (
+    readtime bigint not null,
+    esttime bigint,
+    sentmillis bigint,
+    timemillis bigint,
+    counts smallint,
+    warmedup bool,
+    device text
+  );
+
+create index if not exists ammonia_compact_readtime
+  on kittyfiler.ammonia_compact using brin (readtime);
+
+-- How each device's readings convert to ammonia, value = counts *
+-- slope + intercept. Devices without a row read as raw counts
+create table if not exists kittyfiler.calibration
+  (
+    device text primary key,
+    slope double precision not null default 1,
+    intercept double precision not null default 0
+  );
+
+-- The compact samples with calibration applied, in the same shape
+-- as kittyview. Filter on readtime_us to use the index
+CREATE OR REPLACE VIEW kittyfiler.compactview as
+select a.timemillis,
+       a.counts * coalesce(c.slope, 1) + coalesce(c.intercept, 0) as value,
+       a.warmedup,
+       to_timestamp(a.esttime / 1e6) as esttime,
+       a.device,
+       to_timestamp(a.readtime / 1e6) as readtime,
+       a.counts,
+       a.readtime as readtime_us
+  from kittyfiler.ammonia_compact a
+  left join kittyfiler.calibration c on c.device = a.device;
+
+-- A batch in flight when the connection dropped may have been
+-- committed before kittyfiler sends it again. Keep the first copy of
+-- each sample and let the key turn the rest away. readtime is in the
+-- key because a partitioned table's keys must hold its partition
+-- key, and because sentmillis and timemillis start over each time a
+-- device restarts
+delete from kittyfiler.ammonia a
+ using kittyfiler.ammonia b
+ where a.device = b.device
+   and a.sentmillis = b.sentmillis
+   and a.timemillis = b.timemillis
+   and a.readtime = b.readtime
+   and a.LID > b.LID;
+
+create unique index if not exists ammonia_sample
+  on kittyfiler.ammonia (device, sentmillis, timemillis, readtime);
+
+delete from kittyfiler.ammonia_compact a
+ using kittyfiler.ammonia_compact b
+ where a.device = b.device
+   and a.sentmillis = b.sentmillis
+   and a.timemillis = b.timemillis
+   and a.readtime = b.readtime
+   and a.ctid > b.ctid;
+
+create unique index if not exists ammonia_compact_sample
+  on kittyfiler.ammonia_compact (device, sentmillis, timemillis, readtime);
+
+-- kittyfiler sums each finished bucket up again from the samples of
+-- one device over one stretch of time, at their estimated time or
+-- read time if there is none
+create index if not exists ammonia_device_time
+  on kittyfiler.ammonia (device, (coalesce(esttime, readtime)));
+
+create index if not exists ammonia_compact_device_time
+  on kittyfiler.ammonia_compact (device, (coalesce(esttime, readtime)));
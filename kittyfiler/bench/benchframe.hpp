@@ -0,0 +1,66 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// benchframe.hpp
+
+// Frames shaped like the ones the kittycomfort sketch sends, shared by
+// the benchmarks
+
+#include <sstream>
+#include <string>
+
+#ifndef benchframe_hpp
+#define benchframe_hpp
+
+/// Build a frame the way DataStructure::jsonFullString does
+inline std::string makeFrame(unsigned long sentmillis, size_t samples)
+{
+  std::ostringstream f;
+  f << "{\"project\": \"kittycomfort\",\"sentmillis\": " << sentmillis
+    << ",\"data\": [";
+  for (size_t i = 0; i < samples; i++)
+    {
+      f << "{\"value\": " << 400 + i * 7 << ".00"
+	<< ",\"timemillis\": " << sentmillis - (samples - i) * 10000
+	<< ",\"iswarmedup\": " << (i % 2 ? "true" : "false") << "}";
+      if (i < samples - 1) f << ",";
+    }
+  f << "],\"EOT\": true}\n";
+  return f.str();
+}
+
+#endif
@@ -0,0 +1,476 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// kittybench.cpp
+
+// Time the paths every frame goes through, count the heap allocations
+// they make, and write the results as JSON so releases can be compared
+
+#include "app.hpp"
+#include "cli.hpp"
+#include "connection.hpp"
+#include "database.hpp"
+#include "parser.hpp"
+#include "benchframe.hpp"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <json/json.h>
+
+// Count every allocation made through operator new. Relaxed is enough,
+// the counters are only read between runs
+static std::atomic<unsigned long long> allocs{0};
+static std::atomic<unsigned long long> allocBytes{0};
+
+// GCC at -O2 sees the free below take memory from operator new and
+// doesn't know this is the operator new it came from
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t n)
+{
+  allocs.fetch_add(1, std::memory_order_relaxed);
+  allocBytes.fetch_add(n, std::memory_order_relaxed);
+
+  void* p = malloc(n ? n : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  free(p);
+}
+
+/// A stream buffer that throws away everything written to it
+class NullBuffer : public std::streambuf
+{
+protected:
+  int overflow(int c) override {return c;};
+  std::streamsize xsputn(const char*, std::streamsize n) override
+  {return n;};
+};
+
+/// The outcome of timing one path
+struct Result
+{
+  std::string name;
+  unsigned long long frames = 0;
+  double ns = 0;
+  double allocs = 0;
+  double allocBytes = 0;
+  double bytesPerSec = 0;
+};
+
+/// Call run(i) for frame i = 0, 1 ... until at least ms have passed,
+/// after a short warm up. bytes is the input handled per frame, 0 if
+/// a rate means nothing for this path
+template<typename F>
+Result measure(const std::string& name, size_t bytes, double ms, F run)
+{
+  typedef std::chrono::steady_clock Clock;
+  Result r;
+  r.name = name;
+
+  for (size_t i = 0; i < 256; i++) run(i);
+
+  unsigned long long a = allocs, b = allocBytes;
+  auto start = Clock::now();
+  auto until = start + std::chrono::duration<double, std::milli>(ms);
+  Clock::time_point now;
+
+  // Check the clock every 64 frames so reading it costs little
+  do
+    {
+      for (size_t i = 0; i < 64; i++) run(r.frames++);
+      now = Clock::now();
+    }
+  while (now < until);
+
+  double ns = std::chrono::duration<double, std::nano>(now - start).count();
+  r.ns = ns / r.frames;
+  r.allocs = double(allocs - a) / r.frames;
+  r.allocBytes = double(allocBytes - b) / r.frames;
+  if (bytes > 0) r.bytesPerSec = bytes * 1e9 / r.ns;
+
+  return r;
+}
+
+/// A pseudo terminal with frames written into it from a thread, so
+/// a Connection on the other end reads them like a serial port
+class PtyFeed
+{
+public:
+  PtyFeed(const std::string& data)
+    : _data(data)
+  {
+    _master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (_master < 0 || grantpt(_master) < 0 || unlockpt(_master) < 0)
+      {
+	std::string err = "In PtyFeed::PtyFeed: Could not open pty: ";
+	err += strerror(errno);
+	throw std::runtime_error(err);
+      }
+    _name = ptsname(_master);
+
+    // Never block in write, so the thread always sees _stopping
+    fcntl(_master, F_SETFL, fcntl(_master, F_GETFL) | O_NONBLOCK);
+  }
+
+  ~PtyFeed()
+  {
+    _stopping = 1;
+    if (_thread.joinable()) _thread.join();
+    close(_master);
+  }
+
+  const std::string& name() {return _name;};
+
+  /// Keep writing the data until destroyed. Call once the reader has
+  /// the slave open, or the first writes are lost
+  void start()
+  {
+    _thread = std::thread([this]()
+    {
+      size_t at = 0;
+      struct pollfd p = {_master, POLLOUT, 0};
+
+      while (!_stopping)
+	{
+	  if (poll(&p, 1, 100) <= 0) continue;
+
+	  ssize_t n = write(_master, _data.data() + at, _data.size() - at);
+	  if (n < 0 && errno != EAGAIN && errno != EINTR) break;
+	  if (n > 0) at = (at + n) % _data.size();
+	}
+    });
+  }
+
+private:
+  std::string _data;
+  std::string _name;
+  int _master;
+  std::thread _thread;
+  std::atomic<bool> _stopping{0};
+};
+
+void print(std::ostream& out, const Result& r)
+{
+  out << std::left << std::setw(32) << r.name << std::right
+      << std::fixed << std::setprecision(1)
+      << std::setw(10) << r.ns << " ns/frame"
+      << std::setw(8) << r.allocs << " allocs"
+      << std::setw(9) << r.allocBytes << " B";
+  if (r.bytesPerSec > 0)
+    out << std::setw(9) << r.bytesPerSec / 1e6 << " MB/s";
+  out << std::endl;
+}
+
+Json::Value toJson(const Result& r)
+{
+  Json::Value v;
+  v["name"] = r.name;
+  v["frames"] = Json::UInt64(r.frames);
+  v["ns_per_frame"] = r.ns;
+  v["allocs_per_frame"] = r.allocs;
+  v["alloc_bytes_per_frame"] = r.allocBytes;
+  if (r.bytesPerSec > 0) v["bytes_per_sec"] = r.bytesPerSec;
+  else v["bytes_per_sec"] = Json::Value();
+  return v;
+}
+
+/// Compare against a saved run. Returns the number of paths that got
+/// slower by more than tolerance percent or allocate more per frame
+int compare(const std::vector<Result>& results, const std::string& path,
+	    double tolerance)
+{
+  std::ifstream in(path);
+  Json::Value base;
+  Json::CharReaderBuilder rb;
+  std::string errs;
+
+  if (!in || !Json::parseFromStream(rb, in, &base, &errs))
+    throw std::runtime_error("In compare: Could not read baseline "
+			     + path + " " + errs);
+
+  std::map<std::string, Json::Value> old;
+  for (auto& v : base["results"])
+    old[v["name"].asString()] = v;
+
+  int regressed = 0;
+  std::cout << std::endl << "Against " << path;
+  if (base.isMember("label")) std::cout << " (" << base["label"].asString()
+					<< ")";
+  std::cout << ":" << std::endl;
+
+  for (auto it = results.begin(); it != results.end(); it++)
+    {
+      auto o = old.find(it->name);
+      if (o == old.end()) continue;
+
+      double was = o->second["ns_per_frame"].asDouble();
+      double wasAllocs = o->second["allocs_per_frame"].asDouble();
+      double change = (it->ns / was - 1) * 100;
+      bool slower = change > tolerance;
+      bool fatter = it->allocs > wasAllocs + 0.5;
+
+      std::cout << std::left << std::setw(32) << it->name << std::right
+		<< std::showpos << std::setw(9) << change << "%"
+		<< std::noshowpos << std::setw(8) << it->allocs - wasAllocs
+		<< " allocs" << (slower || fatter ? "  REGRESSED" : "")
+		<< std::endl;
+      if (slower || fatter) regressed++;
+    }
+
+  return regressed;
+}
+
+void printUsage(std::ostream& out)
+{
+  Cli::Usage u;
+
+  u.addApp("kittybench");
+  u.addDescription("Time the paths every frame takes through kittyfiler, "
+		   "counting the heap allocations each one makes.");
+  u.addUseCase({},
+	       {std::make_pair('t', "<ms>"),
+		std::make_pair('o', "<results.json>"),
+		std::make_pair('l', "<label>"),
+		std::make_pair('c', "<baseline.json>"),
+		std::make_pair('r', "<percent>")},
+	       {});
+  u.addUseCase({'h'}, {}, {});
+  u.addOption('t', "time each path for at least <ms>, default 500");
+  u.addOption('o', "write the results to a JSON file");
+  u.addOption('l', "label the results, such as a release or commit");
+  u.addOption('c', "compare against results saved with -o, exiting with "
+	      "an error if any path regressed");
+  u.addOption('r', "how much slower counts as regressed, default 10%");
+  u.addOption('h', "Print this help message, then exit");
+  u.print(out);
+}
+
+int main(int argc, char** argv)
+{
+  try
+    {
+      char oaList[] = {'t','o','l','c','r'};
+      Cli::Args al(argc, argv, oaList, sizeof(oaList)/sizeof(oaList[0]));
+
+      if (al.option('h'))
+	{
+	  printUsage(std::cout);
+	  return 0;
+	}
+
+      double ms = al.option('t') ? std::stod(al.optarg('t')) : 500;
+      std::vector<Result> results;
+      std::vector<std::string> frames;
+      std::vector<std::string> csvs;
+      std::string all;
+
+      // One minute of samples per frame, like the sketch's defaults
+      for (unsigned long i = 1; i <= 64; i++)
+	{
+	  frames.push_back(makeFrame(86400000 + i * 60000, 7));
+	  all += frames.back();
+
+	  std::istringstream in(frames.back());
+	  std::ostringstream csv;
+	  Filer::Conversion::jsonToCSV(in, csv, "1700000000");
+	  csvs.push_back(csv.str());
+	}
+
+      size_t frameBytes = frames.back().size();
+      size_t csvBytes = csvs.back().size();
+      auto frame = [&](size_t i) -> const std::string& {return frames[i % 64];};
+
+      results.push_back(measure("Conversion::jsonToCSV", frameBytes, ms,
+				[&](size_t i)
+      {
+	std::istringstream in(frame(i));
+	std::ostringstream out;
+	Filer::Conversion::jsonToCSV(in, out);
+      }));
+
+      results.push_back(measure("Conversion::jsonToCSV readtime",
+				frameBytes, ms, [&](size_t i)
+      {
+	std::istringstream in(frame(i));
+	std::ostringstream out;
+	Filer::Conversion::jsonToCSV(in, out, "1700000000");
+      }));
+
+      Filer::AmmoniaBatch batch;
+      Filer::FrameInfo info;
+
+      results.push_back(measure("Conversion::jsonToBatch", frameBytes, ms,
+				[&](size_t i)
+      {
+	batch.clear();
+	Filer::Conversion::jsonToBatch(frame(i), batch, info);
+      }));
+
+      results.push_back(measure("FrameParser::parse", frameBytes, ms,
+				[&](size_t i)
+      {
+	batch.clear();
+	Filer::FrameParser::parse(frame(i), batch, info);
+      }));
+
+      // The tokenizer Database::append runs on CSV before inserting
+      results.push_back(measure("Database::parseCSV", csvBytes, ms,
+				[&](size_t i)
+      {
+	std::istringstream in(csvs[i % 64]);
+	std::vector<Filer::Database::svector> dv;
+	Filer::Database::parseCSV(in, dv);
+      }));
+
+      {
+	PtyFeed feed(all);
+	Filer::Connection port(feed.name().c_str());
+	feed.start();
+
+	results.push_back(measure("Connection::readUntil pty", frameBytes,
+				  ms, [&](size_t)
+	{
+	  std::stringstream buffer;
+	  port.readUntil(buffer, '\n');
+	}));
+
+	results.push_back(measure("Connection::readFrame pty", frameBytes,
+				  ms, [&](size_t)
+	{
+	  std::string_view f;
+	  port.readFrame(f, '\n');
+	}));
+      }
+
+      // Keep the terminal clear of frames while printOutput runs
+      Filer::App app;
+      NullBuffer null;
+      std::streambuf* console = std::cout.rdbuf(&null);
+
+      results.push_back(measure("App::printOutput stream", frameBytes, ms,
+				[&](size_t i)
+      {
+	std::istringstream in(frame(i));
+	app.printOutput(in);
+      }));
+
+      results.push_back(measure("App::printOutput frame", frameBytes, ms,
+				[&](size_t i)
+      {
+	app.printOutput(std::string_view(frame(i)));
+      }));
+
+      std::cout.rdbuf(console);
+
+      results.push_back(measure("App::makeTimestamp", 0, ms, [&](size_t i)
+      {
+	Filer::App::makeTimestamp(1700000000 + i);
+      }));
+
+      results.push_back(measure("Stamp::now", 0, ms, [&](size_t)
+      {
+	Filer::Stamp::now();
+      }));
+
+      for (auto it = results.begin(); it != results.end(); it++)
+	print(std::cout, *it);
+
+      Json::Value doc;
+      doc["label"] = al.option('l') ? al.optarg('l') : "";
+      doc["time"] = Json::Int64(time(NULL));
+      doc["frame_bytes"] = Json::UInt64(frameBytes);
+      doc["samples_per_frame"] = 7;
+      doc["results"] = Json::Value(Json::arrayValue);
+      for (auto it = results.begin(); it != results.end(); it++)
+	doc["results"].append(toJson(*it));
+
+      if (al.option('o'))
+	{
+	  std::ofstream out(al.optarg('o'));
+	  Json::StreamWriterBuilder wb;
+	  wb["indentation"] = "  ";
+	  out << Json::writeString(wb, doc) << std::endl;
+	  if (!out)
+	    throw std::runtime_error("In main: Could not write "
+				     + al.optarg('o'));
+	}
+
+      if (al.option('c'))
+	{
+	  double tolerance = al.option('r') ? std::stod(al.optarg('r')) : 10;
+	  int regressed = compare(results, al.optarg('c'), tolerance);
+	  if (regressed > 0)
+	    {
+	      std::cout << regressed << " paths regressed" << std::endl;
+	      return 1;
+	    }
+	}
+    }
+  catch (std::exception& e)
+    {
+      std::cerr << e.what() << std::endl;
+      return -1;
+    }
+
+  return 0;
+}
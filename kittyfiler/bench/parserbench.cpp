@@ -0,0 +1,114 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// parserbench.cpp
+
+// Compare the FrameParser fast path against the jsoncpp parser on
+// frames shaped like the ones the kittycomfort sketch sends
+
+#include "parser.hpp"
+#include "connection.hpp"
+#include "benchframe.hpp"
+#include <chrono>
+#include <string>
+#include <vector>
+
+/// Run parse over every frame reps times, return ns per frame
+template<typename F>
+double run(const std::vector<std::string>& frames, size_t reps, F parse)
+{
+  Filer::AmmoniaBatch batch;
+  Filer::FrameInfo info;
+  auto start = std::chrono::steady_clock::now();
+
+  for (size_t r = 0; r < reps; r++)
+    for (auto it = frames.begin(); it != frames.end(); it++)
+      {
+	batch.clear();
+	parse(*it, batch, info);
+      }
+
+  auto stop = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::nano> d = stop - start;
+  return d.count() / (reps * frames.size());
+}
+
+int main(int argc, char** argv)
+{
+  size_t reps = argc > 1 ? std::stoul(argv[1]) : 20000;
+  std::vector<std::string> frames;
+
+  // One minute of samples per frame, like the sketch's defaults
+  for (unsigned long i = 1; i <= 64; i++)
+    frames.push_back(makeFrame(86400000 + i * 60000, 7));
+
+  // Both parsers must agree before their speed means anything
+  for (auto it = frames.begin(); it != frames.end(); it++)
+    {
+      Filer::AmmoniaBatch a, b;
+      Filer::FrameInfo info;
+      Filer::FrameParser::parseFast(*it, a, info);
+      Filer::Conversion::jsonToBatch(*it, b, info);
+      if (a.sentmillis != b.sentmillis || a.timemillis != b.timemillis
+	  || a.value != b.value || a.warmedup != b.warmedup)
+	{
+	  std::cerr << "Parsers disagree on frame: " << *it;
+	  return 1;
+	}
+    }
+
+  double json = run(frames, reps, [](const std::string& f,
+				     Filer::AmmoniaBatch& b,
+				     const Filer::FrameInfo& i)
+  {
+    Filer::Conversion::jsonToBatch(f, b, i);
+  });
+
+  double fast = run(frames, reps, [](const std::string& f,
+				     Filer::AmmoniaBatch& b,
+				     const Filer::FrameInfo& i)
+  {
+    Filer::FrameParser::parseFast(f, b, i);
+  });
+
+  std::cout << "frame bytes:      " << frames.back().size() << std::endl
+	    << "jsoncpp:          " << json << " ns/frame" << std::endl
+	    << "FrameParser:      " << fast << " ns/frame" << std::endl
+	    << "speedup:          " << json / fast << "x" << std::endl;
+
+  return 0;
+}
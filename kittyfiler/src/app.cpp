@@ -39,8 +39,9 @@
 
 // app.cpp
 #include "app.hpp"
-#include "database.hpp"
 #include "connection.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
 #include <filesystem>
 #include <fstream>
 #include <sstream>
@@ -57,22 +58,81 @@ void Filer::App::printUsage(std::ostream& out)
   u.addDescription(desc);
   u.addUseCase({'p'},
 	       {std::make_pair('f',"<filename>")},
-	       {"<special>"});
-  u.addUseCase({'p','b'},
+	       {"<special> [<special> ...]"});
+  u.addUseCase({'p','b','c','K'},
 	       {std::make_pair('f', "<filename>"),
+		std::make_pair('Q', "<sink>=<policy>,..."),
+		std::make_pair('D', "<depth>"),
+		std::make_pair('F', "<flush>"),
+		std::make_pair('B', "<filename>"),
+		std::make_pair('R', "<rotation>"),
+		std::make_pair('S', "<dir>"),
+		std::make_pair('Z', "<MB>"),
+		std::make_pair('G', "rows=<n>,ms=<ms>"),
+		std::make_pair('A', "<depth>"),
+		std::make_pair('k', "<interval>"),
+		std::make_pair('j', "<journal>"),
+		std::make_pair('M', "<metrics.prom>"),
+		std::make_pair('T', "<trace.json>"),
 		std::make_pair('H', "<host>"),
 		std::make_pair('d', "<database>"),
 		std::make_pair('u', "<user>"),
 		std::make_pair('P', "<password>")},
-	       {"<special>"});
+	       {"<special> [<special> ...]"});
+  u.addUseCase({'p','b','X'},
+	       {std::make_pair('f', "<filename>"),
+		std::make_pair('J', "<journal>")},
+	       {});
   u.addUseCase({'h','L'}, {}, {});
   u.addOption('p', "print raw json to stdout");
   u.addOption('b', "send data to database. Requires connection options");
+  u.addOption('c', "use COPY to upload each frame, only useful with -b");
+  u.addOption('K', "store samples in the compact table, raw readings as "
+	      "smallint and times as epoch microseconds, only useful with "
+	      "-b");
   u.addOption('f', "write data as CSV to file <filename>. must be absolute");
+  u.addOption('F', "when the CSV file is flushed and synced: frame, "
+	      "ms=<N> or bytes=<N>. Default ms=1000. SIGHUP reopens it");
+  u.addOption('B', "write data to block file <filename>, a compact "
+	      "binary format read back with kittydump. A block is "
+	      "written every 4096 samples or 10 minutes");
+  u.addOption('R', "rotate the -f and -B files by size, by time or both, "
+	      "as size=<N>[K|M|G],interval=<N>[s|m|h|d]. Closed files are "
+	      "named for the times they cover and gzipped unless "
+	      "compress=none is added");
   u.addOption('H', "Hostname for database, only useful with -b");
   u.addOption('d', "Database name for database, only useful with -b");
   u.addOption('u', "User name for database, only useful with -b");
   u.addOption('P', "Password for database, only useful with -b");
+  u.addOption('Q', "what each sink does when its queue is full. Sinks "
+	      "are print, file, binary and db, policies are block, drop (the "
+	      "oldest frame) and spill (to memory, up to 16384 frames). Default "
+	      "block");
+  u.addOption('D', "frames each sink may have queued, default 64");
+  u.addOption('S', "keep samples in directory <dir> while the database "
+	      "is down or behind, and replay them when it catches up. "
+	      "Only useful with -b");
+  u.addOption('Z', "disk the spool may use in MB before dropping the "
+	      "oldest samples, default 256");
+  u.addOption('G', "group commit: hold samples from every device and "
+	      "send them in one transaction once there are <n> of them or "
+	      "the oldest is <ms> old. Defaults rows=5000,ms=1000");
+  u.addOption('A', "send to the database in libpq pipeline mode, with "
+	      "up to <depth> inserts waiting for an answer at once");
+  u.addOption('k', "drop monthly partitions of the ammonia table once "
+	      "they are older than <interval>, such as '2 years'. Not "
+	      "with -K");
+  u.addOption('j', "record every byte read from the ports, and when it "
+	      "arrived, to <journal>");
+  u.addOption('J', "read <journal> instead of ports, feeding it through "
+	      "the same outputs at the pace it was recorded");
+  u.addOption('X', "replay the journal as fast as possible and report "
+	      "the throughput, only useful with -J");
+  u.addOption('M', "write counters and stage latencies in Prometheus "
+	      "text format to <metrics.prom> every 15 s");
+  u.addOption('T', "record a span for every read, parse, output and "
+	      "database statement, written to <trace.json> on exit for "
+	      "Perfetto or chrome://tracing");
   u.addOption('h', "Print this help message, then exit");
   u.addOption('L', "Print licensing information, then exit");
 
@@ -97,6 +157,19 @@ void Filer::App::printLicense(std::ostream& out)
   lfile.close();
 }
 
+std::string Filer::App::makeTimestamp(time_t tt,
+				      const std::string& format)
+{
+  struct tm ttm;
+  const size_t tbsize = 30;
+  char readTime[tbsize];
+
+  localtime_r(&tt, &ttm);
+  strftime(readTime, tbsize, format.c_str(), &ttm);
+
+  return std::string(readTime);
+}
+
 Filer::App::App()
 {
 }
@@ -117,13 +190,36 @@ Filer::App::App(const App& other)
 }
 
 Filer::App::App(App&& other)
-  :_argList(other._argList)
+  :_argList(other._argList), _auth(other._auth), _db(other._db),
+   _csv(other._csv), _blocks(other._blocks),
+   _compressor(other._compressor), _spool(other._spool),
+   _replayer(other._replayer), _async(other._async),
+   _bootstrapped(other._bootstrapped), _groupRows(other._groupRows),
+   _groupMs(other._groupMs)
 {
-  _argList = NULL;
+  other._argList = NULL;
+  other._auth = NULL;
+  other._db = NULL;
+  other._csv = NULL;
+  other._blocks = NULL;
+  other._compressor = NULL;
+  other._spool = NULL;
+  other._replayer = NULL;
+  other._async = NULL;
 }
 
 Filer::App::~App()
 {
+  // Stop the replayer before what it uses goes away
+  delete _replayer;
+  delete _async;
+  delete _spool;
+  delete _db;
+  delete _csv;
+  delete _blocks;
+  // After the writers, which may still hand it files
+  delete _compressor;
+  delete _auth;
   delete _argList;
 }
 
@@ -147,6 +243,23 @@ bool Filer::App::isInit()
   return _argList;
 }
 
+Filer::Database& Filer::App::_database()
+{
+  if (!_db)
+    {
+      _auth = new Filer::auth;
+      if (argList().option('d')) _auth->database = argList().optarg('d');
+      if (argList().option('H')) _auth->host = argList().optarg('H');
+      if (argList().option('u')) _auth->user = argList().optarg('u');
+      if (argList().option('P')) _auth->password = argList().optarg('P');
+      _db = new Filer::Database(_auth);
+      if (argList().option('c')) _db->setIngest(Filer::Database::COPY);
+      if (argList().option('K')) _db->setLayout(Filer::Database::COMPACT);
+    }
+
+  return *_db;
+}
+
 int Filer::App::printOutput(std::istream& instream)
 {
   while (instream.good())
@@ -167,43 +280,505 @@ int Filer::App::printOutput(std::istream& instream)
   return 0;
 }
 
-int Filer::App::fileOutput(std::istream& instream)
+int Filer::App::printOutput(std::string_view frame)
+{
+  std::cout.write(frame.data(), frame.size());
+
+  if (std::cout.bad())
+    {
+      std::string err = "In Filer::App::printOutput: ";
+      err += "Failed to write frame to stdout";
+      throw std::runtime_error(err);
+    }
+
+  return 0;
+}
+
+Filer::Rotator* Filer::App::_rotator(const std::string& path)
 {
-  std::ofstream ofile;
-  ofile.open(argList().optarg('f').c_str(),
-	     std::ofstream::out | std::ofstream::app);
-  Filer::Conversion::jsonToCSV(instream, ofile);
+  if (!argList().option('R')) return NULL;
+
+  Filer::RotatePolicy p = Filer::RotatePolicy::parse(argList().optarg('R'));
+  if (p.compress && !_compressor) _compressor = new Filer::Compressor;
+  return new Filer::Rotator(path, p, _compressor);
+}
+
+int Filer::App::fileSetup()
+{
+  Filer::CsvWriter::policy p = Filer::CsvWriter::INTERVAL;
+  size_t every = 1000;
+  if (argList().option('F'))
+    Filer::CsvWriter::parsePolicy(argList().optarg('F'), p, every);
+
+  delete _csv;
+  _csv = new Filer::CsvWriter(argList().optarg('f'), p, every,
+			      _rotator(argList().optarg('f')));
+  return 0;
+}
+
+int Filer::App::fileOutput(const Filer::AmmoniaBatch& batch)
+{
+  Filer::StageTimer timer(Filer::metrics().csv);
+  if (!_csv) fileSetup();
+  _csv->write(batch);
+  return 0;
+}
+
+void Filer::App::fileTick()
+{
+  if (_csv) _csv->tick();
+}
+
+int Filer::App::blockSetup()
+{
+  delete _blocks;
+  _blocks = new Filer::BlockWriter(argList().optarg('B'), 4096, 600,
+				   _rotator(argList().optarg('B')));
   return 0;
 }
 
-int Filer::App::databaseOutput(std::istream& instream,
-			const std::string& stringTime)
-{
-  std::stringstream sparsed;
-  Filer::auth a;
-  if (argList().option('d')) a.database = argList().optarg('d');
-  if (argList().option('H')) a.host = argList().optarg('H');
-  if (argList().option('u')) a.user = argList().optarg('u');
-  if (argList().option('P')) a.password = argList().optarg('P');
-  instream.seekg(0);
-  Filer::Conversion::jsonToCSV(instream, sparsed, stringTime);
-  Filer::Database db(&a);
-  std::string tablename = "kittyfiler.ammonia";
-
-  Filer::Database::svector headers =
-    {std::string("sentmillis"),
-     std::string("timemillis"),
-     std::string("value"),
-     std::string("warmedup"),
-     std::string("readtime")};
-  Filer::Database::svector types =
-    {std::string("bigint"),
-     std::string("bigint"),
-     std::string("numeric"),
-     std::string("bool"),
-     std::string("timestamptz")};
-  if (!db.tableExists(tablename))
-    db.createTable(tablename, headers, types);
-  db.append(tablename, sparsed, headers);
+int Filer::App::blockOutput(const Filer::AmmoniaBatch& batch)
+{
+  Filer::StageTimer timer(Filer::metrics().binary);
+  if (!_blocks) blockSetup();
+  _blocks->write(batch);
   return 0;
 }
+
+void Filer::App::blockTick()
+{
+  if (_blocks) _blocks->tick();
+}
+
+void Filer::App::reopen()
+{
+  if (_csv) _csv->reopen();
+  if (_blocks) _blocks->reopen();
+}
+
+int Filer::App::databaseSetup()
+{
+  // Group commit: hold samples until there are rows of them or the
+  // oldest is ms old, then send them in one transaction
+  if (argList().option('G'))
+    {
+      std::map<std::string, std::string> g =
+	Cli::splitPairs(argList().optarg('G'));
+      _groupRows = 5000;
+      _groupMs = 1000;
+
+      for (auto it = g.begin(); it != g.end(); it++)
+	{
+	  if (it->first == "rows") _groupRows = std::stoul(it->second);
+	  else if (it->first == "ms") _groupMs = std::stoul(it->second);
+	  else
+	    throw std::runtime_error("In Filer::App::databaseSetup: "
+				     "Unknown group commit setting "
+				     + it->first);
+	}
+
+      if (_groupRows == 0) _groupRows = 1;
+    }
+
+  // Buckets are held a couple of minutes past their end, as a frame
+  // carries samples from the minute before it was sent
+  const long long second = 1000000000;
+  _rollups.emplace_back("kittyfiler.ammonia_1m", 60 * second, 120 * second);
+  _rollups.emplace_back("kittyfiler.ammonia_1h", 3600 * second,
+			120 * second);
+
+  // Only the wide table is partitioned, so there is nothing for -k
+  // to drop in the compact one
+  if (argList().option('K'))
+    {
+      if (argList().option('k'))
+	throw std::runtime_error("In Filer::App::databaseSetup: -k only "
+				 "applies to kittyfiler.ammonia, not the "
+				 "compact table written with -K");
+      _table = "kittyfiler.ammonia_compact";
+    }
+
+  if (argList().option('S'))
+    {
+      size_t maxBytes = 256 << 20;
+      if (argList().option('Z'))
+	maxBytes = std::stoull(argList().optarg('Z')) << 20;
+      _spool = new Filer::Spool(argList().optarg('S'), maxBytes);
+      _replayer = new Filer::SpoolReplayer
+	(*_spool, [this](const Filer::AmmoniaBatch& b)
+	{
+	  _databaseAppend(b);
+	});
+    }
+
+  int applied = 0;
+
+  try
+    {
+      std::lock_guard<std::mutex> guard(_dbLock);
+      applied = _database().bootstrap();
+      _bootstrapped = 1;
+    }
+  catch (std::exception& e)
+    {
+      // Without a spool there is nowhere to keep samples, so give up
+      if (!_spool || _database().isConnected()) throw;
+      std::cerr << "Database unavailable, spooling to "
+		<< _spool->dir() << ": " << e.what() << std::endl;
+    }
+
+  // Pipelined writes get a connection of their own
+  if (argList().option('A'))
+    _async = new Filer::AsyncWriter
+      (_database().conString(), _table,
+       std::stoul(argList().optarg('A')),
+       [this](const Filer::AmmoniaBatch& b, const std::string& error)
+       {
+	 _asyncFailed(b, error);
+       },
+       argList().option('K'));
+
+  _databaseMaintain();
+
+  if (_replayer) _replayer->start();
+  return applied;
+}
+
+void Filer::App::_databaseAppend(const Filer::AmmoniaBatch& batch)
+{
+  std::lock_guard<std::mutex> guard(_dbLock);
+  Filer::Database& db = _database();
+
+  try
+    {
+      // The schema could not be set up if the database was down at
+      // startup
+      if (!_bootstrapped)
+	{
+	  db.bootstrap();
+	  _bootstrapped = 1;
+	}
+
+      db.append(_table, batch);
+
+      // Spooled samples land long after their frame, so their
+      // buckets are summed again
+      _rollupAdd(batch);
+    }
+  catch (std::exception& e)
+    {
+      // Only bad samples are worth skipping. A read-only standby, a
+      // full disk or a missing table will be sorted out eventually
+      if (db.isConnected() && Filer::Database::refused(e))
+	throw Filer::SpoolRejected(e.what());
+      throw;
+    }
+}
+
+int Filer::App::databaseOutput(const Filer::AmmoniaBatch& batch,
+			       bool behind)
+{
+  if (batch.empty()) return 0;
+  _databaseMaintain();
+
+  // Estimated while the frame is fresh, so the time stored with it
+  // never depends on how long the database took
+  _estimated = batch;
+  _clock.estimate(_estimated);
+
+  _rollupAdd(_estimated);
+  _rollupStore(0);
+
+  if (_groupRows == 0)
+    {
+      _databaseWrite(_estimated, behind);
+      return 0;
+    }
+
+  if (_group.empty()) _groupSince = std::chrono::steady_clock::now();
+  _group.append(_estimated);
+  _groupBehind = behind;
+
+  // Under steady load the sink is never idle, so check the age here
+  // too
+  if (_group.size() >= _groupRows) databaseFlush();
+  else databaseTick();
+  return 0;
+}
+
+void Filer::App::databaseTick()
+{
+  _databaseMaintain();
+  _rollupStore(0);
+  if (_async) _async->poll();
+  if (_group.empty()) return;
+
+  auto age = std::chrono::steady_clock::now() - _groupSince;
+  if (age >= std::chrono::milliseconds(_groupMs)) databaseFlush();
+}
+
+void Filer::App::databaseFinish()
+{
+  databaseFlush();
+  _rollupStore(1);
+}
+
+void Filer::App::_rollupAdd(const Filer::AmmoniaBatch& batch)
+{
+  std::lock_guard<std::mutex> guard(_rollupLock);
+  for (auto it = _rollups.begin(); it != _rollups.end(); it++)
+    it->add(batch);
+}
+
+void Filer::App::_rollupStore(bool all)
+{
+  auto now = std::chrono::steady_clock::now();
+  if (!all && now < _rollupAt) return;
+  _rollupAt = now + std::chrono::seconds(10);
+
+  long long wall = std::chrono::duration_cast<std::chrono::nanoseconds>
+    (std::chrono::system_clock::now().time_since_epoch()).count();
+
+  std::lock_guard<std::mutex> guard(_dbLock);
+  std::lock_guard<std::mutex> rollupGuard(_rollupLock);
+
+  for (auto it = _rollups.begin(); it != _rollups.end(); it++)
+    {
+      it->close(wall, all);
+      if (it->waiting() == 0 || !_bootstrapped) continue;
+
+      try
+	{
+	  _database().upsert(it->table(), _table, it->width(),
+			     it->pending());
+	  it->stored();
+	}
+      catch (std::exception& e)
+	{
+	  std::cerr << "Rollups for " << it->table() << " not stored, "
+		    << "keeping " << it->waiting() << " buckets: "
+		    << e.what() << std::endl;
+	}
+    }
+}
+
+void Filer::App::_databaseMaintain()
+{
+  auto now = std::chrono::steady_clock::now();
+  if (now < _maintainAt) return;
+  _maintainAt = now + std::chrono::hours(1);
+
+  try
+    {
+      std::lock_guard<std::mutex> guard(_dbLock);
+      if (!_bootstrapped) return;
+
+      // The compact table is not partitioned
+      if (_table != "kittyfiler.ammonia") return;
+
+      Filer::Database& db = _database();
+      db.ensurePartitions(_table, "readtime");
+
+      if (argList().option('k'))
+	{
+	  int dropped = db.dropPartitions(_table, argList().optarg('k'));
+	  if (dropped > 0)
+	    std::cerr << "Dropped " << dropped << " partitions older than "
+		      << argList().optarg('k') << std::endl;
+	}
+    }
+  catch (std::exception& e)
+    {
+      // Samples can still be stored while the months ahead exist, so
+      // try again next time round
+      std::cerr << "Database maintenance failed: " << e.what()
+		<< std::endl;
+    }
+}
+
+void Filer::App::databaseFlush()
+{
+  if (!_group.empty())
+    {
+      // Held samples stay held if this throws, so the flush at
+      // shutdown tries them again
+      Filer::TraceSpan span("group commit", "rows", _group.size());
+      _databaseWrite(_group, _groupBehind);
+      _group.clear();
+    }
+
+  if (_async) _async->drain();
+}
+
+void Filer::App::_databaseWrite(const Filer::AmmoniaBatch& batch,
+				bool behind)
+{
+  // Pipelined writes may only overtake the spool while it is empty
+  if (_async && (!_spool || (!behind && _spool->empty())))
+    {
+      try
+	{
+	  _async->send(batch);
+	}
+      catch (std::exception& e)
+	{
+	  if (!_spool) throw;
+	  std::cerr << "Database unavailable, spooling to "
+		    << _spool->dir() << ": " << e.what() << std::endl;
+	  _spool->write(batch);
+	}
+      return;
+    }
+
+  if (!_spool)
+    {
+      try
+	{
+	  _database().append(_table, batch);
+	}
+      catch (std::exception& e)
+	{
+	  // One bad frame must not stop the samples behind it
+	  if (!_database().isConnected() || !Filer::Database::refused(e))
+	    throw;
+	  _databaseRefused(batch, e);
+	}
+      return;
+    }
+
+  // Anything already spooled must reach the database first, so keep
+  // spooling until the replayer has caught up
+  if (behind || !_spool->empty())
+    {
+      _spool->write(batch);
+      return;
+    }
+
+  try
+    {
+      _databaseAppend(batch);
+    }
+  catch (Filer::SpoolRejected& e)
+    {
+      // The replayer finds the bad samples and skips them, without
+      // holding up the ones behind
+      std::cerr << "Database refused " << batch.size()
+		<< " samples, spooling: " << e.what() << std::endl;
+      _spool->write(batch);
+    }
+  catch (std::exception& e)
+    {
+      std::cerr << "Database unavailable, spooling to "
+		<< _spool->dir() << ": " << e.what() << std::endl;
+      _spool->write(batch);
+    }
+}
+
+void Filer::App::_asyncFailed(const Filer::AmmoniaBatch& batch,
+			      const std::string& error)
+{
+  if (_spool)
+    {
+      std::cerr << "Database did not take " << batch.size()
+		<< " samples, spooling: " << error << std::endl;
+      _spool->write(batch);
+      return;
+    }
+
+  // Try once more on its own, which throws if it fails again. COPY
+  // can't skip samples the table already has, so a batch that was
+  // committed before the connection dropped fails as a duplicate
+  std::cerr << "Database did not take " << batch.size()
+	    << " samples, retrying: " << error << std::endl;
+  try
+    {
+      _database().append(_table, batch);
+    }
+  catch (std::exception& e)
+    {
+      if (Filer::Database::duplicate(e))
+	std::cerr << "Samples were already stored" << std::endl;
+      else if (_database().isConnected() && Filer::Database::refused(e))
+	_databaseRefused(batch, e);
+      else
+	throw;
+    }
+}
+
+void Filer::App::_databaseRefused(const Filer::AmmoniaBatch& batch,
+				  const std::exception& e)
+{
+  if (batch.size() == 1)
+    {
+      std::cerr << "Database refused a sample, skipping: " << e.what()
+		<< std::endl;
+      batch.writeCSV(std::cerr, 1);
+      _rejected++;
+      return;
+    }
+
+  // A group commit or pipelined batch holds many frames, most of them
+  // likely fine
+  std::cerr << "Database refused " << batch.size()
+	    << " samples, storing them one at a time: " << e.what()
+	    << std::endl;
+
+  Filer::AmmoniaBatch row;
+  for (size_t i = 0; i < batch.size(); i++)
+    {
+      row.clear();
+      row.append(batch, i, 1);
+
+      try
+	{
+	  _database().append(_table, row);
+	}
+      catch (std::exception& r)
+	{
+	  if (!_database().isConnected() || !Filer::Database::refused(r))
+	    throw;
+	  std::cerr << "Database refused a sample, skipping: " << r.what()
+		    << std::endl;
+	  row.writeCSV(std::cerr, 1);
+	  _rejected++;
+	}
+    }
+}
+
+void Filer::App::report(std::ostream& out)
+{
+  if (argList().option('b'))
+    out << "database: rejected=" << _rejected << std::endl;
+
+  if (!_spool) return;
+
+  out << "spool: bytes=" << _spool->bytes()
+      << " empty=" << (_spool->empty() ? "yes" : "no")
+      << " replayed=" << _replayer->replayed()
+      << " rejected=" << _replayer->rejected()
+      << " lost_bytes=" << _spool->lost() << std::endl;
+}
+
+void Filer::App::writeMetrics(std::ostream& out)
+{
+  if (argList().option('b'))
+    out << "# HELP kittyfiler_db_rejected_total Samples the database "
+      "refused as bad data and were skipped\n"
+	<< "# TYPE kittyfiler_db_rejected_total counter\n"
+	<< "kittyfiler_db_rejected_total " << _rejected << "\n";
+
+  if (!_spool) return;
+
+  out << "# HELP kittyfiler_spool_bytes Bytes of samples waiting in the "
+    "spool for the database\n"
+      << "# TYPE kittyfiler_spool_bytes gauge\n"
+      << "kittyfiler_spool_bytes " << _spool->bytes() << "\n"
+      << "# HELP kittyfiler_spool_replayed_total Samples sent on from the "
+    "spool\n"
+      << "# TYPE kittyfiler_spool_replayed_total counter\n"
+      << "kittyfiler_spool_replayed_total " << _replayer->replayed() << "\n"
+      << "# HELP kittyfiler_spool_lost_bytes_total Spooled bytes thrown "
+    "away to stay under the size limit\n"
+      << "# TYPE kittyfiler_spool_lost_bytes_total counter\n"
+      << "kittyfiler_spool_lost_bytes_total " << _spool->lost() << "\n";
+}
@@ -42,7 +42,19 @@
 #define APP_HPP
 
 #include "cli.hpp"
+#include "database.hpp"
+#include "csvwriter.hpp"
+#include "blockfile.hpp"
+#include "spool.hpp"
+#include "asyncwriter.hpp"
+#include "clock.hpp"
+#include "rollup.hpp"
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <mutex>
+#include <string_view>
+#include <ctime>
 
 namespace Filer
 {
@@ -56,6 +68,11 @@ namespace Filer
     /// Print license information to stream
     static void printLicense(std::ostream& out = std::cout);
 
+    /// Format a time as a local timestamp string
+    static std::string makeTimestamp(time_t tt,
+				     const std::string& format =
+				     "%m/%d/%Y %T %Z");
+
     /// Default constructor with members un-initialized
     App();
 
@@ -77,12 +94,59 @@ namespace Filer
     /// Print Json output string to stdout
     int printOutput(std::istream& instream);
 
+    /// Print a raw Json frame to stdout
+    int printOutput(std::string_view frame);
+
+    /// Open the CSV file given in arglist
+    int fileSetup();
+
     /// Print CSV format to file specified in arglist
-    int fileOutput(std::istream& instream);
+    int fileOutput(const Filer::AmmoniaBatch& batch);
+
+    /// Flush the CSV file if its interval has passed. Call from the
+    /// thread running fileOutput
+    void fileTick();
+
+    /// Open the block file given in arglist
+    int blockSetup();
+
+    /// Write samples to the block file given in arglist
+    int blockOutput(const Filer::AmmoniaBatch& batch);
+
+    /// Write a block if the oldest held sample is old enough. Call
+    /// from the thread running blockOutput
+    void blockTick();
+
+    /// Reopen output files by name, as after logrotate has moved them
+    void reopen();
+
+    /// Connect to the database and bring its schema up to date
+    int databaseSetup();
+
+    /// Upload parsed samples to database. With a spool, samples go
+    /// to disk instead while the database is down or behind is set
+    int databaseOutput(const Filer::AmmoniaBatch& batch,
+		       bool behind = 0);
+
+    /// Commit the samples held back for a group commit once the
+    /// oldest has waited long enough. Call from the thread running
+    /// databaseOutput
+    void databaseTick();
+
+    /// Commit every sample held back for a group commit and wait for
+    /// pipelined writes to be answered. Call once databaseOutput has
+    /// stopped being called
+    void databaseFlush();
+
+    /// Commit everything held back, then store every rollup bucket,
+    /// finished or not. Call once at exit
+    void databaseFinish();
+
+    /// Print database, spool and replay counters
+    void report(std::ostream& out);
 
-    /// Parse json string then upload to database
-    int databaseOutput(std::istream& instream,
-		       const std::string& stringTime);
+    /// Write the same counters in Prometheus text format
+    void writeMetrics(std::ostream& out);
 
     /// Get reference to arglist
     Cli::Args& argList();
@@ -98,6 +162,76 @@ namespace Filer
 
   private:
     Cli::Args* _argList = NULL;
+    Filer::auth* _auth = NULL;
+    Filer::Database* _db = NULL;
+    Filer::CsvWriter* _csv = NULL;
+    Filer::BlockWriter* _blocks = NULL;
+    Filer::Compressor* _compressor = NULL;
+    Filer::Spool* _spool = NULL;
+    Filer::SpoolReplayer* _replayer = NULL;
+    Filer::AsyncWriter* _async = NULL;
+    /// Held by whichever of the sink and replayer is using _db
+    std::mutex _dbLock;
+    bool _bootstrapped = 0;
+    /// Samples the database refused without a spool to skip them
+    std::atomic<unsigned long long> _rejected{0};
+    /// Where samples are stored, the compact table with -K
+    std::string _table = "kittyfiler.ammonia";
+    /// Samples held for the next group commit, see -G. With
+    /// _groupRows 0 every frame is committed on its own
+    Filer::AmmoniaBatch _group;
+    size_t _groupRows = 0;
+    unsigned _groupMs = 0;
+    std::chrono::steady_clock::time_point _groupSince;
+    bool _groupBehind = 0;
+    /// Fits each device's millis() to the wall clock so rows are
+    /// stored with an estimated time
+    Filer::ClockEstimator _clock;
+    Filer::AmmoniaBatch _estimated;
+    /// When partitions are next created and, with -k, dropped
+    std::chrono::steady_clock::time_point _maintainAt;
+    /// Buckets of the per minute and per hour summaries with new
+    /// samples, and when closed buckets are next stored. The lock
+    /// is taken after _dbLock when both are needed
+    std::vector<Filer::Rollup> _rollups;
+    std::mutex _rollupLock;
+    std::chrono::steady_clock::time_point _rollupAt;
+
+    /// Make a rotator for the output file at path if -R was given
+    Filer::Rotator* _rotator(const std::string& path);
+
+    /// Get the database, connecting on first use
+    Filer::Database& _database();
+
+    /// Store samples in the database, throwing SpoolRejected if it
+    /// refused the samples themselves
+    void _databaseAppend(const Filer::AmmoniaBatch& batch);
+
+    /// Send samples to the database, or the spool if it is down or
+    /// behind is set
+    void _databaseWrite(const Filer::AmmoniaBatch& batch, bool behind);
+
+    /// Make the coming months' partitions and drop those past the
+    /// -k retention, at most once an hour
+    void _databaseMaintain();
+
+    /// Note the rollup buckets of samples stored in the database
+    void _rollupAdd(const Filer::AmmoniaBatch& batch);
+
+    /// Sum up the rollup buckets that are over again, or every one
+    /// with all set. Buckets the database does not take are kept for
+    /// the next try
+    void _rollupStore(bool all);
+
+    /// With no spool to put them in, store the samples of a batch
+    /// the database refused one at a time, logging, counting and
+    /// skipping only those refused on their own
+    void _databaseRefused(const Filer::AmmoniaBatch& batch,
+			  const std::exception& e);
+
+    /// Deal with a batch the pipelined writer could not store
+    void _asyncFailed(const Filer::AmmoniaBatch& batch,
+		      const std::string& error);
   };
 }
 
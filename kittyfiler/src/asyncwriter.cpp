@@ -0,0 +1,280 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// asyncwriter.cpp
+
+#include "asyncwriter.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include <cstdio>
+#include <stdexcept>
+#include <poll.h>
+#include <libpq-fe.h>
+
+namespace Filer
+{
+  AsyncWriter::AsyncWriter(const std::string& conninfo,
+			   const std::string& table, size_t depth,
+			   failure failed, bool compact)
+    : _conninfo(conninfo), _depth(depth > 0 ? depth : 1), _compact(compact),
+      _failed(failed)
+  {
+    _query = "INSERT INTO " + table;
+
+    if (_compact)
+      {
+	_query += " (sentmillis,timemillis,counts,warmedup,readtime,device,";
+	_query += "esttime) SELECT * FROM unnest($1::bigint[], $2::bigint[],";
+	_query += " $3::smallint[], $4::bool[], $5::bigint[], $6::text[],";
+	_query += " $7::bigint[]) ON CONFLICT DO NOTHING";
+	return;
+      }
+
+    _query += " (sentmillis,timemillis,value,warmedup,readtime,device,";
+    _query += "esttime) SELECT * FROM unnest($1::bigint[], $2::bigint[],";
+    _query += " $3::numeric[], $4::bool[], $5::timestamptz[], $6::text[],";
+    _query += " $7::timestamptz[]) ON CONFLICT DO NOTHING";
+  }
+
+  AsyncWriter::~AsyncWriter()
+  {
+    if (_conn) PQfinish(_conn);
+  }
+
+  void AsyncWriter::_connect()
+  {
+    if (_wasConnected) metrics().reconnects.add();
+
+    _conn = PQconnectdb(_conninfo.c_str());
+
+    if (PQstatus(_conn) != CONNECTION_OK
+	|| PQsetnonblocking(_conn, 1) != 0
+	|| PQenterPipelineMode(_conn) != 1)
+      {
+	std::string err = "In AsyncWriter::_connect: ";
+	err += PQerrorMessage(_conn);
+	PQfinish(_conn);
+	_conn = NULL;
+	throw std::runtime_error(err);
+      }
+
+    _wasConnected = 1;
+  }
+
+  // Give up on the connection. Whatever was in flight may or may not
+  // have been committed, so hand it back to be dealt with. Samples
+  // already stored are turned away by the table's key when sent again
+  void AsyncWriter::_close(const std::string& why)
+  {
+    std::deque<Sent> lost;
+    lost.swap(_flight);
+
+    if (_conn) PQfinish(_conn);
+    _conn = NULL;
+
+    // Every batch gets its chance even if one of them can't be saved
+    std::string error;
+    for (auto it = lost.begin(); it != lost.end(); it++)
+      {
+	try
+	  {
+	    _failed(it->batch, why);
+	  }
+	catch (std::exception& e)
+	  {
+	    if (error.empty()) error = e.what();
+	  }
+      }
+
+    if (!error.empty()) throw std::runtime_error(error);
+  }
+
+  // Append s to an array literal as a quoted element
+  static void quoted(std::string& out, std::string_view s)
+  {
+    out += '"';
+    for (char c : s)
+      {
+	if (c == '"' || c == '\\') out += '\\';
+	out += c;
+      }
+    out += '"';
+  }
+
+  // Build the array parameters, one per column, as text, reusing their buffers
+  void AsyncWriter::_encode(const AmmoniaBatch& batch)
+  {
+    char num[32];
+
+    for (int p = 0; p < 7; p++) _params[p].assign(1, '{');
+
+    for (size_t i = 0; i < batch.size(); i++)
+      {
+	if (i > 0)
+	  for (int p = 0; p < 7; p++) _params[p] += ',';
+
+	_params[0] += std::to_string(batch.sentmillis[i]);
+	_params[1] += std::to_string(batch.timemillis[i]);
+	_params[3] += batch.warmedup[i] ? 't' : 'f';
+	quoted(_params[5], batch.device[i]);
+
+	if (_compact)
+	  {
+	    _params[2] += std::to_string(AmmoniaBatch::counts(batch.value[i]));
+	    _params[4] += std::to_string(batch.readtime[i] / 1000);
+	    if (batch.esttime[i])
+	      _params[6] += std::to_string(batch.esttime[i] / 1000);
+	    else
+	      _params[6] += "NULL";
+	    continue;
+	  }
+
+	snprintf(num, sizeof(num), "%.17g", batch.value[i]);
+	_params[2] += num;
+	quoted(_params[4], AmmoniaBatch::isoTimestamp(batch.readtime[i]));
+	if (batch.esttime[i])
+	  quoted(_params[6], AmmoniaBatch::isoTimestamp(batch.esttime[i]));
+	else
+	  _params[6] += "NULL";
+      }
+
+    for (int p = 0; p < 7; p++) _params[p] += '}';
+  }
+
+  void AsyncWriter::send(const AmmoniaBatch& batch)
+  {
+    if (batch.empty()) return;
+    if (!_conn) _connect();
+
+    // Wait for room, handling answers as they come
+    while (_conn && _flight.size() >= _depth) _read(1);
+    if (!_conn) _connect();
+
+    _encode(batch);
+    const char* values[7];
+    for (int p = 0; p < 7; p++) values[p] = _params[p].c_str();
+
+    if (PQsendQueryParams(_conn, _query.c_str(), 7, NULL, values,
+			  NULL, NULL, 0) != 1
+	|| PQpipelineSync(_conn) != 1)
+      {
+	std::string err = "In AsyncWriter::send: ";
+	err += PQerrorMessage(_conn);
+	_close(err);
+	throw std::runtime_error(err);
+      }
+
+    _flight.push_back({batch, Trace::now(), ""});
+    _read(0);
+  }
+
+  void AsyncWriter::poll()
+  {
+    if (_conn) _read(0);
+  }
+
+  void AsyncWriter::drain()
+  {
+    while (_conn && !_flight.empty()) _read(1);
+  }
+
+  // Push out anything still buffered and handle every answer that has
+  // arrived. With wait set, block until at least one batch is answered
+  bool AsyncWriter::_read(bool wait)
+  {
+    bool done = 0;
+
+    for (;;)
+      {
+	int flushed = PQflush(_conn);
+
+	if (flushed < 0 || PQconsumeInput(_conn) != 1)
+	  {
+	    std::string err = "In AsyncWriter::_read: ";
+	    err += PQerrorMessage(_conn);
+	    _close(err);
+	    return done;
+	  }
+
+	// Each batch answers with its INSERT's result, a null, then
+	// the result of its sync
+	while (!_flight.empty() && !PQisBusy(_conn))
+	  {
+	    PGresult* r = PQgetResult(_conn);
+	    if (!r) continue;
+
+	    Sent& s = _flight.front();
+	    ExecStatusType status = PQresultStatus(r);
+
+	    if (status == PGRES_FATAL_ERROR)
+	      s.error = PQresultErrorMessage(r);
+	    else if (status == PGRES_PIPELINE_ABORTED && s.error.empty())
+	      s.error = "Pipeline aborted";
+
+	    PQclear(r);
+	    if (status != PGRES_PIPELINE_SYNC) continue;
+
+	    int64_t now = Trace::now();
+	    metrics().db.record(now - s.at);
+	    if (Trace::enabled())
+	      Trace::record("pipelined INSERT", s.at, now, "rows",
+			    s.batch.size());
+
+	    Sent answered = std::move(s);
+	    _flight.pop_front();
+	    done = 1;
+
+	    if (!answered.error.empty())
+	      _failed(answered.batch, answered.error);
+	  }
+
+	if (!wait || done || _flight.empty()) return done;
+
+	// Sleep until the server answers, or there is room to send
+	// more of what is buffered
+	struct pollfd p = {PQsocket(_conn), POLLIN, 0};
+	if (flushed == 1) p.events |= POLLOUT;
+
+	if (::poll(&p, 1, 30000) == 0)
+	  {
+	    _close("In AsyncWriter::_read: No answer from the server "
+		   "in 30 s");
+	    return done;
+	  }
+      }
+  }
+}
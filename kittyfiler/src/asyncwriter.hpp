@@ -0,0 +1,112 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// asyncwriter.hpp
+
+#include "batch.hpp"
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+
+#ifndef asyncwriter_hpp
+#define asyncwriter_hpp
+
+typedef struct pg_conn PGconn;
+
+namespace Filer
+{
+  /// Sends batches over one connection in libpq pipeline mode, so
+  /// many are on the wire at once instead of each waiting out a round
+  /// trip. Every batch is one INSERT from unnest()ed arrays followed
+  /// by a sync, making it a transaction of its own whose result can
+  /// be told apart from the others
+  class AsyncWriter
+  {
+  public:
+    /// Called with a batch the server refused, or that was in flight
+    /// when the connection broke, and why
+    typedef std::function<void(const AmmoniaBatch&,
+			       const std::string&)> failure;
+
+    /// Write to table over a connection made from conninfo, with at
+    /// most depth batches waiting for an answer. With compact set the
+    /// table has the compact layout, see Database::COMPACT
+    AsyncWriter(const std::string& conninfo, const std::string& table,
+		size_t depth, failure failed, bool compact = 0);
+    AsyncWriter(const AsyncWriter& o) = delete;
+    ~AsyncWriter();
+
+    /// Queue batch on the connection, connecting first if needed.
+    /// Waits while depth batches are in flight. Throws if the
+    /// connection can't be made or breaks while sending
+    void send(const AmmoniaBatch& batch);
+
+    /// Handle any answers that have arrived, without waiting
+    void poll();
+
+    /// Wait until every batch in flight is answered
+    void drain();
+
+    size_t inFlight() {return _flight.size();};
+
+  private:
+    struct Sent
+    {
+      AmmoniaBatch batch;
+      int64_t at;
+      std::string error;
+    };
+
+    std::string _conninfo;
+    std::string _query;
+    size_t _depth;
+    bool _compact;
+    failure _failed;
+    PGconn* _conn = NULL;
+    bool _wasConnected = 0;
+    std::deque<Sent> _flight;
+    std::string _params[7];
+
+    void _connect();
+    void _close(const std::string& why);
+    void _encode(const AmmoniaBatch& batch);
+    bool _read(bool wait);
+  };
+}
+
+#endif
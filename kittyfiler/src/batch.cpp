@@ -0,0 +1,292 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// batch.cpp
+
+#include "batch.hpp"
+#include <ctime>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+
+namespace Filer
+{
+  Stamp Stamp::now()
+  {
+    struct timespec real, mono;
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+
+    Stamp s;
+    s.realtime = real.tv_sec * 1000000000LL + real.tv_nsec;
+    s.monotonic = mono.tv_sec * 1000000000LL + mono.tv_nsec;
+    return s;
+  }
+
+  void AmmoniaBatch::push(const FrameInfo& info, long long sent,
+			  long long time, double val, bool warm)
+  {
+    device.push_back(info.device);
+    sentmillis.push_back(sent);
+    timemillis.push_back(time);
+    value.push_back(val);
+    warmedup.push_back(warm);
+    readtime.push_back(info.readtime);
+    esttime.push_back(0);
+  }
+
+  void AmmoniaBatch::append(const AmmoniaBatch& o)
+  {
+    append(o, 0, o.size());
+  }
+
+  void AmmoniaBatch::append(const AmmoniaBatch& o, size_t from, size_t n)
+  {
+    size_t to = from + n;
+    device.insert(device.end(), o.device.begin() + from,
+		  o.device.begin() + to);
+    sentmillis.insert(sentmillis.end(), o.sentmillis.begin() + from,
+		      o.sentmillis.begin() + to);
+    timemillis.insert(timemillis.end(), o.timemillis.begin() + from,
+		      o.timemillis.begin() + to);
+    value.insert(value.end(), o.value.begin() + from, o.value.begin() + to);
+    warmedup.insert(warmedup.end(), o.warmedup.begin() + from,
+		    o.warmedup.begin() + to);
+    readtime.insert(readtime.end(), o.readtime.begin() + from,
+		    o.readtime.begin() + to);
+    esttime.insert(esttime.end(), o.esttime.begin() + from,
+		   o.esttime.begin() + to);
+  }
+
+  void AmmoniaBatch::reserve(size_t n)
+  {
+    device.reserve(n);
+    sentmillis.reserve(n);
+    timemillis.reserve(n);
+    value.reserve(n);
+    warmedup.reserve(n);
+    readtime.reserve(n);
+    esttime.reserve(n);
+  }
+
+  void AmmoniaBatch::clear()
+  {
+    device.clear();
+    sentmillis.clear();
+    timemillis.clear();
+    value.clear();
+    warmedup.clear();
+    readtime.clear();
+    esttime.clear();
+  }
+
+  void AmmoniaBatch::truncate(size_t n)
+  {
+    if (n >= size()) return;
+    device.resize(n);
+    sentmillis.resize(n);
+    timemillis.resize(n);
+    value.resize(n);
+    warmedup.resize(n);
+    readtime.resize(n);
+    esttime.resize(n);
+  }
+
+  void AmmoniaBatch::writeCSV(std::ostream& out, bool withTime) const
+  {
+    std::string rows;
+    appendCSV(rows, withTime);
+    out.write(rows.data(), rows.size());
+  }
+
+  void AmmoniaBatch::appendCSV(std::string& out, bool withTime) const
+  {
+    for (size_t i = 0; i < size(); i++)
+      {
+	// %g prints values the same way an ostream does by default
+	char row[96];
+	int n = snprintf(row, sizeof(row), "%lld,%lld,%g,%s",
+			 sentmillis[i], timemillis[i], value[i],
+			 warmedup[i] ? "true" : "false");
+	out.append(row, n);
+	if (withTime)
+	  {
+	    out += ',';
+	    out += isoTimestamp(readtime[i]);
+	  }
+	out += ',';
+	out += device[i];
+	out += '\n';
+      }
+  }
+
+  // Fixed width fields copied in host byte order
+  template<typename T>
+  static void encodeField(std::string& out, T v)
+  {
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+  }
+
+  template<typename T>
+  static bool decodeField(std::string_view& in, T& v)
+  {
+    if (in.size() < sizeof(v)) return false;
+    memcpy(&v, in.data(), sizeof(v));
+    in.remove_prefix(sizeof(v));
+    return true;
+  }
+
+  void AmmoniaBatch::encode(std::string& out) const
+  {
+    encodeField<uint32_t>(out, size());
+
+    for (size_t i = 0; i < size(); i++)
+      {
+	encodeField<uint16_t>(out, device[i].size());
+	out.append(device[i]);
+	encodeField<int64_t>(out, sentmillis[i]);
+	encodeField<int64_t>(out, timemillis[i]);
+	encodeField<double>(out, value[i]);
+	encodeField<uint8_t>(out, warmedup[i]);
+	encodeField<int64_t>(out, readtime[i]);
+      }
+
+    // Estimated times follow the rows, so records written before
+    // they were kept still decode
+    for (size_t i = 0; i < size(); i++)
+      encodeField<int64_t>(out, esttime[i]);
+  }
+
+  bool AmmoniaBatch::decode(std::string_view data)
+  {
+    size_t start = size();
+    uint32_t rows;
+
+    if (!decodeField(data, rows)) return false;
+
+    for (uint32_t i = 0; i < rows; i++)
+      {
+	uint16_t len;
+	int64_t sent, time, read;
+	double val;
+	uint8_t warm;
+
+	if (!decodeField(data, len) || data.size() < len)
+	  {
+	    truncate(start);
+	    return false;
+	  }
+
+	FrameInfo info;
+	info.device = intern(data.substr(0, len));
+	data.remove_prefix(len);
+
+	if (!decodeField(data, sent) || !decodeField(data, time)
+	    || !decodeField(data, val) || !decodeField(data, warm)
+	    || !decodeField(data, read))
+	  {
+	    truncate(start);
+	    return false;
+	  }
+
+	info.readtime = read;
+	push(info, sent, time, val, warm);
+      }
+
+    if (data.size() == rows * sizeof(int64_t))
+      for (uint32_t i = 0; i < rows; i++)
+	decodeField(data, esttime[start + i]);
+
+    if (!data.empty())
+      {
+	truncate(start);
+	return false;
+      }
+
+    return true;
+  }
+
+  std::string_view AmmoniaBatch::intern(std::string_view name)
+  {
+    // Set nodes never move, so views into them stay valid
+    static std::set<std::string, std::less<>> names;
+    static std::mutex lock;
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = names.find(name);
+    if (it == names.end()) it = names.emplace(name).first;
+    return *it;
+  }
+
+  std::string AmmoniaBatch::isoTimestamp(long long ns)
+  {
+    time_t tt = ns / 1000000000;
+    long long us = (ns % 1000000000) / 1000;
+
+    // Keep the fraction positive for times before the epoch
+    if (us < 0)
+      {
+	tt--;
+	us += 1000000;
+      }
+
+    struct tm ttm;
+    gmtime_r(&tt, &ttm);
+
+    char out[64];
+    snprintf(out, sizeof(out), "%04d-%02d-%02d %02d:%02d:%02d.%06lld+00",
+	     ttm.tm_year + 1900, ttm.tm_mon + 1, ttm.tm_mday,
+	     ttm.tm_hour, ttm.tm_min, ttm.tm_sec, us);
+    return std::string(out);
+  }
+
+  short AmmoniaBatch::counts(double value)
+  {
+    if (!(value >= 0 && value <= 65535) || value != (long) value)
+      {
+	std::string e = "In AmmoniaBatch::counts: ";
+	e += std::to_string(value);
+	e += " is not a raw sensor reading";
+	throw std::range_error(e);
+      }
+
+    return (short) (uint16_t) value;
+  }
+}
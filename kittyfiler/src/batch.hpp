@@ -0,0 +1,147 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// batch.hpp
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef batch_hpp
+#define batch_hpp
+
+namespace Filer
+{
+  /// One moment read from both host clocks back to back, in
+  /// nanoseconds. realtime is since the epoch and may be stepped,
+  /// monotonic only ever moves forward
+  struct Stamp
+  {
+    long long realtime = 0;
+    long long monotonic = 0;
+
+    /// Read CLOCK_REALTIME and CLOCK_MONOTONIC now
+    static Stamp now();
+  };
+
+  /// Where and when a frame was read, stamped on each of its samples
+  struct FrameInfo
+  {
+    /// Interned name of the device the frame came from
+    std::string_view device;
+    /// Host time the frame's last byte was read, nanoseconds since
+    /// the epoch
+    long long readtime = 0;
+    /// CLOCK_MONOTONIC at the same moment, for measuring intervals
+    /// that a step of the wall clock would spoil
+    long long monotonic = 0;
+  };
+
+  /// Ammonia samples held column by column, filled straight from a
+  /// parsed frame and read by every output
+  struct AmmoniaBatch
+  {
+    /// Device names, all interned so they outlive the batch
+    std::vector<std::string_view> device;
+    std::vector<long long> sentmillis;
+    std::vector<long long> timemillis;
+    std::vector<double> value;
+    std::vector<bool> warmedup;
+    /// Host time the frame was read, nanoseconds since the epoch
+    std::vector<long long> readtime;
+    /// Host time the sample was taken as estimated from the device's
+    /// clock, nanoseconds since the epoch. 0 until estimated
+    std::vector<long long> esttime;
+
+    /// Number of samples held
+    size_t size() const {return value.size();};
+
+    /// Check if no samples are held
+    bool empty() const {return value.empty();};
+
+    /// Add one sample to the end of every column
+    void push(const FrameInfo& info, long long sent, long long time,
+	      double val, bool warm);
+
+    /// Append every sample of another batch
+    void append(const AmmoniaBatch& o);
+
+    /// Append the n samples of another batch starting at from
+    void append(const AmmoniaBatch& o, size_t from, size_t n);
+
+    /// Reserve room for n samples in every column
+    void reserve(size_t n);
+
+    /// Drop all samples but keep the allocated columns
+    void clear();
+
+    /// Drop every sample after the first n
+    void truncate(size_t n);
+
+    /// Write samples as sentmillis,timemillis,value,warmedup CSV
+    /// rows, then readtime if withTime is set, then device
+    void writeCSV(std::ostream& out, bool withTime = 0) const;
+
+    /// Append the same CSV rows as writeCSV to the end of out
+    void appendCSV(std::string& out, bool withTime = 0) const;
+
+    /// Append every sample to out in a compact binary form, only
+    /// meant to be read back by decode on the same host
+    void encode(std::string& out) const;
+
+    /// Append the samples encoded in data, return false and leave
+    /// the batch as it was if data is malformed
+    bool decode(std::string_view data);
+
+    /// Return a copy of name that lives as long as the program, the
+    /// same view for every equal name
+    static std::string_view intern(std::string_view name);
+
+    /// Format a readtime as an ISO 8601 UTC timestamp with
+    /// microseconds, as Postgres reads it for timestamptz
+    static std::string isoTimestamp(long long ns);
+
+    /// The value as the uint16_t ADC reading the sketch sends, in
+    /// the two bytes of a smallint, so its -1 for an unset sensor
+    /// reads back as -1. Throws std::range_error if value is not
+    /// such a reading
+    static short counts(double value);
+  };
+}
+
+#endif
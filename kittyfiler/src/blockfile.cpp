@@ -0,0 +1,829 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// blockfile.cpp
+
+#include "blockfile.hpp"
+#include "crc.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Filer
+{
+  const char BlockFile::magic[8] = {'K','I','T','T','Y','C','B','1'};
+
+  // A block is "KBLK", the payload length, a CRC-32 of everything
+  // after the CRC, the row count and the time ranges, then the
+  // payload. Integers in the header are little endian
+  static const char blockMagic[4] = {'K','B','L','K'};
+  static const size_t headerSize = 48;
+
+  static void putLE(std::string& out, uint64_t v, int bytes)
+  {
+    for (int i = 0; i < bytes; i++)
+      out += static_cast<char>((v >> (8 * i)) & 0xff);
+  }
+
+  static uint64_t getLE(const char* p, int bytes)
+  {
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+      v = (v << 8) | static_cast<unsigned char>(p[i]);
+    return v;
+  }
+
+  static void putVarint(std::string& out, uint64_t v)
+  {
+    while (v >= 0x80)
+      {
+	out += static_cast<char>((v & 0x7f) | 0x80);
+	v >>= 7;
+      }
+    out += static_cast<char>(v);
+  }
+
+  static uint64_t zigzag(long long v)
+  {
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+  }
+
+  static long long unzigzag(uint64_t v)
+  {
+    return static_cast<long long>((v >> 1) ^ (~(v & 1) + 1));
+  }
+
+  static void corrupt(const std::string& what)
+  {
+    std::string err = "In Filer::BlockFile::decode: Corrupt block, ";
+    err += what;
+    throw std::runtime_error(err);
+  }
+
+  /// Reads the payload of a block front to back
+  class BlockCursor
+  {
+  public:
+    explicit BlockCursor(std::string_view data) :_data(data) {};
+
+    uint64_t varint()
+    {
+      uint64_t v = 0;
+      for (int shift = 0; shift < 64; shift += 7)
+	{
+	  if (_pos >= _data.size()) corrupt("varint past end");
+	  unsigned char c = _data[_pos++];
+	  v |= static_cast<uint64_t>(c & 0x7f) << shift;
+	  if (!(c & 0x80)) return v;
+	}
+      corrupt("varint too long");
+      return 0;
+    }
+
+    std::string_view bytes(size_t n)
+    {
+      if (n > _data.size() - _pos) corrupt("field past end");
+      std::string_view v = _data.substr(_pos, n);
+      _pos += n;
+      return v;
+    }
+
+    bool done() {return _pos == _data.size();};
+
+  private:
+    std::string_view _data;
+    size_t _pos = 0;
+  };
+
+  /// Packs values of any bit width, most significant bit first
+  class BitWriter
+  {
+  public:
+    explicit BitWriter(std::string& out) :_out(out) {};
+
+    void put(uint64_t v, int n)
+    {
+      while (n > 0)
+	{
+	  int room = 8 - _used;
+	  int take = n < room ? n : room;
+	  unsigned bits = (v >> (n - take)) & ((1u << take) - 1);
+
+	  if (_used == 0) _out += '\0';
+	  _out.back() |= static_cast<char>(bits << (room - take));
+	  _used = (_used + take) % 8;
+	  n -= take;
+	}
+    }
+
+  private:
+    std::string& _out;
+    int _used = 0;
+  };
+
+  class BitReader
+  {
+  public:
+    explicit BitReader(std::string_view in) :_in(in) {};
+
+    uint64_t get(int n)
+    {
+      uint64_t v = 0;
+      while (n > 0)
+	{
+	  if (_pos >= _in.size()) corrupt("value bits past end");
+	  int room = 8 - _used;
+	  int take = n < room ? n : room;
+	  unsigned byte = static_cast<unsigned char>(_in[_pos]);
+	  v = (v << take) | ((byte >> (room - take)) & ((1u << take) - 1));
+	  _used += take;
+	  if (_used == 8)
+	    {
+	      _used = 0;
+	      _pos++;
+	    }
+	  n -= take;
+	}
+      return v;
+    }
+
+  private:
+    std::string_view _in;
+    size_t _pos = 0;
+    int _used = 0;
+  };
+
+  // The first value, the first delta, then the change in delta from
+  // one value to the next. Steady sample intervals give runs of zero,
+  // stored as a 0 and the length of the run
+  static void putDeltas(std::string& out, const std::vector<long long>& v)
+  {
+    uint64_t prev = 0;
+    uint64_t prevDelta = 0;
+    uint64_t zeros = 0;
+
+    for (size_t i = 0; i < v.size(); i++)
+      {
+	// Unsigned arithmetic wraps instead of overflowing
+	uint64_t cur = static_cast<uint64_t>(v[i]);
+	uint64_t delta = i == 0 ? 0 : cur - prev;
+	uint64_t dod = i == 0 ? cur : delta - prevDelta;
+	prev = cur;
+	prevDelta = delta;
+
+	if (dod == 0)
+	  {
+	    zeros++;
+	    continue;
+	  }
+
+	if (zeros > 0)
+	  {
+	    putVarint(out, 0);
+	    putVarint(out, zeros);
+	    zeros = 0;
+	  }
+	putVarint(out, zigzag(static_cast<long long>(dod)));
+      }
+
+    if (zeros > 0)
+      {
+	putVarint(out, 0);
+	putVarint(out, zeros);
+      }
+  }
+
+  static void getDeltas(BlockCursor& in, std::vector<long long>& v,
+			size_t rows)
+  {
+    uint64_t prev = 0;
+    uint64_t prevDelta = 0;
+    uint64_t zeros = 0;
+
+    for (size_t i = 0; i < rows; i++)
+      {
+	uint64_t dod = 0;
+
+	if (zeros > 0)
+	  zeros--;
+	else
+	  {
+	    uint64_t z = in.varint();
+	    if (z == 0)
+	      {
+		zeros = in.varint();
+		if (zeros == 0 || zeros > rows - i) corrupt("bad zero run");
+		zeros--;
+	      }
+	    else
+	      dod = static_cast<uint64_t>(unzigzag(z));
+	  }
+
+	uint64_t cur = i == 0 ? dod : prev + prevDelta + dod;
+	prevDelta = i == 0 ? 0 : cur - prev;
+	prev = cur;
+	v.push_back(static_cast<long long>(cur));
+      }
+
+    if (zeros > 0) corrupt("zero run past end");
+  }
+
+  // Runs of equal values, each stored as its change from the run
+  // before and its length. Suits columns that step once per frame,
+  // like sentmillis and readtime
+  static void putRuns(std::string& out, const std::vector<long long>& v)
+  {
+    uint64_t prev = 0;
+
+    for (size_t i = 0; i < v.size();)
+      {
+	size_t run = 1;
+	while (i + run < v.size() && v[i + run] == v[i]) run++;
+
+	uint64_t cur = static_cast<uint64_t>(v[i]);
+	putVarint(out, zigzag(static_cast<long long>(cur - prev)));
+	putVarint(out, run);
+	prev = cur;
+	i += run;
+      }
+  }
+
+  static void getRuns(BlockCursor& in, std::vector<long long>& v,
+		      size_t rows)
+  {
+    uint64_t prev = 0;
+    size_t done = 0;
+
+    while (done < rows)
+      {
+	uint64_t cur = prev + static_cast<uint64_t>(unzigzag(in.varint()));
+	uint64_t run = in.varint();
+	if (run == 0 || run > rows - done) corrupt("bad value run");
+	v.insert(v.end(), run, static_cast<long long>(cur));
+	prev = cur;
+	done += run;
+      }
+  }
+
+  // An integer column is stored whichever way comes out smaller,
+  // behind a byte saying which
+  enum {DELTAS = 0, RUNS = 1};
+
+  static void putColumn(std::string& out, const std::vector<long long>& v)
+  {
+    std::string deltas;
+    std::string runs;
+    putDeltas(deltas, v);
+    putRuns(runs, v);
+
+    if (runs.size() < deltas.size())
+      {
+	out += static_cast<char>(RUNS);
+	out += runs;
+      }
+    else
+      {
+	out += static_cast<char>(DELTAS);
+	out += deltas;
+      }
+  }
+
+  static void getColumn(BlockCursor& in, std::vector<long long>& v,
+			size_t rows)
+  {
+    switch (in.bytes(1)[0])
+      {
+      case DELTAS: getDeltas(in, v, rows); break;
+      case RUNS: getRuns(in, v, rows); break;
+      default: corrupt("unknown column encoding");
+      }
+  }
+
+  // Gorilla XOR compression: a 0 bit for a repeated value, otherwise
+  // the bits that changed, reusing the previous window of leading
+  // and trailing zeros when they fit in it
+  static void putValues(std::string& out, const std::vector<double>& v)
+  {
+    BitWriter bw(out);
+    uint64_t prev = 0;
+    int lead = -1;
+    int trail = 0;
+
+    for (size_t i = 0; i < v.size(); i++)
+      {
+	uint64_t cur;
+	memcpy(&cur, &v[i], sizeof(cur));
+
+	if (i == 0)
+	  {
+	    bw.put(cur, 64);
+	    prev = cur;
+	    continue;
+	  }
+
+	uint64_t x = cur ^ prev;
+	prev = cur;
+
+	if (x == 0)
+	  {
+	    bw.put(0, 1);
+	    continue;
+	  }
+
+	bw.put(1, 1);
+	int l = __builtin_clzll(x);
+	int t = __builtin_ctzll(x);
+	if (l > 31) l = 31;
+
+	if (lead >= 0 && l >= lead && t >= trail)
+	  {
+	    bw.put(0, 1);
+	    bw.put(x >> trail, 64 - lead - trail);
+	  }
+	else
+	  {
+	    int m = 64 - l - t;
+	    bw.put(1, 1);
+	    bw.put(l, 5);
+	    bw.put(m == 64 ? 0 : m, 6);
+	    bw.put(x >> t, m);
+	    lead = l;
+	    trail = t;
+	  }
+      }
+  }
+
+  static void getValues(std::string_view in, std::vector<double>& v,
+			size_t rows)
+  {
+    BitReader br(in);
+    uint64_t prev = 0;
+    int lead = -1;
+    int trail = 0;
+
+    for (size_t i = 0; i < rows; i++)
+      {
+	uint64_t cur;
+
+	if (i == 0)
+	  cur = br.get(64);
+	else if (br.get(1) == 0)
+	  cur = prev;
+	else if (br.get(1) == 0)
+	  {
+	    if (lead < 0) corrupt("value window used before set");
+	    cur = prev ^ (br.get(64 - lead - trail) << trail);
+	  }
+	else
+	  {
+	    lead = br.get(5);
+	    int m = br.get(6);
+	    if (m == 0) m = 64;
+	    if (lead + m > 64) corrupt("value window too wide");
+	    trail = 64 - lead - m;
+	    cur = prev ^ (br.get(m) << trail);
+	  }
+
+	double d;
+	memcpy(&d, &cur, sizeof(d));
+	v.push_back(d);
+	prev = cur;
+      }
+  }
+
+  void BlockFile::encode(const AmmoniaBatch& batch, std::string& out)
+  {
+    size_t start = out.size();
+    size_t rows = batch.size();
+    if (rows == 0) return;
+
+    auto time = std::minmax_element(batch.timemillis.begin(),
+				    batch.timemillis.end());
+    auto read = std::minmax_element(batch.readtime.begin(),
+				    batch.readtime.end());
+
+    out.append(blockMagic, sizeof(blockMagic));
+    putLE(out, 0, 4);  // payload length, filled in below
+    putLE(out, 0, 4);  // CRC, filled in below
+    putLE(out, rows, 4);
+    putLE(out, *time.first, 8);
+    putLE(out, *time.second, 8);
+    putLE(out, *read.first, 8);
+    putLE(out, *read.second, 8);
+
+    // Devices: a dictionary, then runs of dictionary indexes
+    std::map<std::string_view, size_t> index;
+    std::vector<std::string_view> names;
+    for (size_t i = 0; i < rows; i++)
+      if (index.emplace(batch.device[i], names.size()).second)
+	names.push_back(batch.device[i]);
+
+    putVarint(out, names.size());
+    for (size_t i = 0; i < names.size(); i++)
+      {
+	putVarint(out, names[i].size());
+	out.append(names[i]);
+      }
+
+    for (size_t i = 0; i < rows;)
+      {
+	size_t run = 1;
+	while (i + run < rows && batch.device[i + run] == batch.device[i])
+	  run++;
+	putVarint(out, index[batch.device[i]]);
+	putVarint(out, run);
+	i += run;
+      }
+
+    putColumn(out, batch.sentmillis);
+    putColumn(out, batch.timemillis);
+    putColumn(out, batch.readtime);
+
+    std::string values;
+    putValues(values, batch.value);
+    putVarint(out, values.size());
+    out += values;
+
+    std::string warm((rows + 7) / 8, '\0');
+    for (size_t i = 0; i < rows; i++)
+      if (batch.warmedup[i]) warm[i / 8] |= static_cast<char>(1 << (i % 8));
+    out += warm;
+
+    // Fill in the length and CRC now the payload is known
+    std::string len;
+    putLE(len, out.size() - start - headerSize, 4);
+    out.replace(start + 4, 4, len);
+
+    std::string crc;
+    putLE(crc, crc32(out.data() + start + 12, out.size() - start - 12), 4);
+    out.replace(start + 8, 4, crc);
+  }
+
+  size_t BlockFile::header(std::string_view data, BlockHeader& h)
+  {
+    if (data.size() < headerSize) return 0;
+
+    if (memcmp(data.data(), blockMagic, sizeof(blockMagic)) != 0)
+      corrupt("bad magic");
+
+    const char* p = data.data();
+    size_t size = headerSize + getLE(p + 4, 4);
+    h.rows = getLE(p + 12, 4);
+    h.minTime = getLE(p + 16, 8);
+    h.maxTime = getLE(p + 24, 8);
+    h.minRead = getLE(p + 32, 8);
+    h.maxRead = getLE(p + 40, 8);
+
+    return data.size() < size ? 0 : size;
+  }
+
+  void BlockFile::decode(std::string_view block, AmmoniaBatch& batch)
+  {
+    BlockHeader h;
+    size_t size = header(block, h);
+    if (size == 0) corrupt("block cut short");
+
+    if (crc32(block.data() + 12, size - 12) != getLE(block.data() + 8, 4))
+      corrupt("checksum mismatch");
+
+    BlockCursor in(block.substr(headerSize, size - headerSize));
+    size_t rows = h.rows;
+    size_t start = batch.size();
+
+    std::vector<std::string_view> names(in.varint());
+    for (size_t i = 0; i < names.size(); i++)
+      names[i] = AmmoniaBatch::intern(in.bytes(in.varint()));
+
+    std::vector<std::string_view> device;
+    while (device.size() < rows)
+      {
+	uint64_t which = in.varint();
+	uint64_t run = in.varint();
+	if (which >= names.size() || run > rows - device.size())
+	  corrupt("bad device run");
+	device.insert(device.end(), run, names[which]);
+      }
+
+    AmmoniaBatch b;
+    b.device.swap(device);
+    getColumn(in, b.sentmillis, rows);
+    getColumn(in, b.timemillis, rows);
+    getColumn(in, b.readtime, rows);
+    getValues(in.bytes(in.varint()), b.value, rows);
+
+    std::string_view warm = in.bytes((rows + 7) / 8);
+    for (size_t i = 0; i < rows; i++)
+      b.warmedup.push_back(warm[i / 8] & (1 << (i % 8)));
+
+    if (!in.done()) corrupt("trailing bytes");
+
+    // Blocks keep what was read, times are estimated again on load
+    b.esttime.assign(rows, 0);
+    batch.reserve(start + rows);
+    batch.append(b);
+  }
+
+  BlockWriter::BlockWriter(const std::string& path, size_t rows,
+			   unsigned seconds, Rotator* rotator)
+    :_path(path), _rows(rows), _seconds(seconds), _rotator(rotator)
+  {
+    _pending.reserve(rows);
+    _open();
+  }
+
+  BlockWriter::~BlockWriter()
+  {
+    try
+      {
+	flush();
+      }
+    catch (std::exception& e)
+      {
+      }
+
+    if (_fd >= 0) close(_fd);
+    delete _rotator;
+  }
+
+  void BlockWriter::_open()
+  {
+    _torn = -1;
+    _fd = open(_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+	       0644);
+
+    struct stat st;
+    if (_fd < 0 || fstat(_fd, &st) < 0)
+      {
+	std::string err = "In Filer::BlockWriter::_open: ";
+	err += "Could not open " + _path + ": ";
+	err += strerror(errno);
+	throw std::runtime_error(err);
+      }
+
+    // Cut off a block torn by a crash part way through a write, so
+    // new blocks follow the last intact one
+    size_t valid = _validate(st.st_size);
+    if (valid < static_cast<size_t>(st.st_size))
+      {
+	std::cerr << "BlockWriter: dropping " << st.st_size - valid
+		  << " torn bytes from " << _path << std::endl;
+	if (ftruncate(_fd, valid) < 0)
+	  {
+	    std::string err = "In Filer::BlockWriter::_open: ";
+	    err += "Could not truncate " + _path + ": ";
+	    err += strerror(errno);
+	    throw std::runtime_error(err);
+	  }
+      }
+
+    // A new file starts with the magic, an old one already has it
+    if (valid == 0
+	&& ::write(_fd, BlockFile::magic, sizeof(BlockFile::magic))
+	!= sizeof(BlockFile::magic))
+      {
+	std::string err = "In Filer::BlockWriter::_open: ";
+	err += "Could not write " + _path + ": ";
+	err += strerror(errno);
+	throw std::runtime_error(err);
+      }
+  }
+
+  // Return the length of the magic and the run of whole, intact
+  // blocks after it, or 0 if not even the magic was written
+  size_t BlockWriter::_validate(size_t size)
+  {
+    if (size < sizeof(BlockFile::magic)) return 0;
+
+    int fd = open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      {
+	std::string err = "In Filer::BlockWriter::_validate: ";
+	err += "Could not open " + _path + ": ";
+	err += strerror(errno);
+	throw std::runtime_error(err);
+      }
+
+    char m[sizeof(BlockFile::magic)];
+    if (pread(fd, m, sizeof(m), 0) != sizeof(m)
+	|| memcmp(m, BlockFile::magic, sizeof(m)) != 0)
+      {
+	close(fd);
+	std::string err = "In Filer::BlockWriter::_validate: ";
+	err += _path + " is not a kittyfiler block file";
+	throw std::runtime_error(err);
+      }
+
+    size_t off = sizeof(BlockFile::magic);
+    std::string block;
+
+    while (off + headerSize <= size)
+      {
+	block.resize(headerSize);
+	if (pread(fd, &block[0], headerSize, off)
+	    != static_cast<ssize_t>(headerSize))
+	  break;
+	if (memcmp(block.data(), blockMagic, sizeof(blockMagic)) != 0) break;
+
+	uint64_t len = getLE(block.data() + 4, 4);
+	if (len > size - off - headerSize) break;
+
+	block.resize(headerSize + len);
+	if (pread(fd, &block[headerSize], len, off + headerSize)
+	    != static_cast<ssize_t>(len))
+	  break;
+	if (crc32(block.data() + 12, block.size() - 12)
+	    != getLE(block.data() + 8, 4))
+	  break;
+
+	off += block.size();
+      }
+
+    close(fd);
+    return off;
+  }
+
+  void BlockWriter::write(const AmmoniaBatch& batch)
+  {
+    if (batch.empty()) return;
+
+    if (_pending.empty()) _oldest = std::chrono::steady_clock::now();
+    _pending.append(batch);
+    if (_rotator) _rotator->saw(batch);
+
+    if (_pending.size() >= _rows) flush();
+    tick();
+  }
+
+  void BlockWriter::tick()
+  {
+    if (_reopen)
+      {
+	flush();
+	close(_fd);
+	_fd = -1;
+	_reopen = 0;
+	_open();
+	return;
+      }
+
+    if (_rotator && _rotator->due()) _rotate();
+
+    if (_pending.empty()) return;
+
+    auto age = std::chrono::steady_clock::now() - _oldest;
+    if (age >= std::chrono::seconds(_seconds)) flush();
+  }
+
+  void BlockWriter::flush()
+  {
+    if (_pending.empty()) return;
+
+    // A block that failed part way must be cut off before the next
+    // one goes after it, or the reader stops at it
+    if (_torn >= 0)
+      {
+	if (ftruncate(_fd, _torn) < 0)
+	  {
+	    std::string err = "In Filer::BlockWriter::flush: ";
+	    err += "Could not truncate " + _path + ": ";
+	    err += strerror(errno);
+	    throw std::runtime_error(err);
+	  }
+	_torn = -1;
+      }
+
+    _block.clear();
+    BlockFile::encode(_pending, _block);
+
+    off_t start = lseek(_fd, 0, SEEK_END);
+    if (start < 0)
+      {
+	std::string err = "In Filer::BlockWriter::flush: ";
+	err += "Could not seek " + _path + ": ";
+	err += strerror(errno);
+	throw std::runtime_error(err);
+      }
+
+    // Blocks are written whole with one call, so a crash leaves at
+    // most a cut off block at the end for the reader to stop at
+    size_t done = 0;
+    while (done < _block.size())
+      {
+	ssize_t n = ::write(_fd, _block.data() + done,
+			    _block.size() - done);
+	if (n < 0 && errno == EINTR) continue;
+	if (n < 0)
+	  {
+	    // Cut off what got out, trying again next flush if even
+	    // that fails. The samples are kept for the next flush
+	    std::string err = "In Filer::BlockWriter::flush: ";
+	    err += "Could not write " + _path + ": ";
+	    err += strerror(errno);
+	    if (done > 0 && ftruncate(_fd, start) < 0) _torn = start;
+	    throw std::runtime_error(err);
+	  }
+	done += n;
+      }
+
+    if (_rotator) _rotator->wrote(_block.size());
+    _pending.clear();
+
+    if (fsync(_fd) < 0)
+      {
+	std::string err = "In Filer::BlockWriter::flush: ";
+	err += "Could not sync " + _path + ": ";
+	err += strerror(errno);
+	throw std::runtime_error(err);
+      }
+  }
+
+  // Close off the active file and start a new one in its place
+  void BlockWriter::_rotate()
+  {
+    flush();
+    close(_fd);
+    _fd = -1;
+    _rotator->rotate();
+    _open();
+  }
+
+  BlockReader::BlockReader(const std::string& path)
+    :_path(path), _in(path, std::ios::binary)
+  {
+    char m[sizeof(BlockFile::magic)];
+
+    if (!_in.read(m, sizeof(m))
+	|| memcmp(m, BlockFile::magic, sizeof(m)) != 0)
+      {
+	std::string err = "In Filer::BlockReader::BlockReader: ";
+	err += _path + " is not a kittyfiler block file";
+	throw std::runtime_error(err);
+      }
+  }
+
+  bool BlockReader::next(BlockHeader& h, AmmoniaBatch* batch)
+  {
+    _block.resize(headerSize);
+    if (!_in.read(&_block[0], headerSize)) return false;
+
+    size_t size = headerSize + getLE(_block.data() + 4, 4);
+    BlockFile::header(_block, h);
+
+    if (!batch)
+      {
+	// Skip the payload without decoding it
+	_in.ignore(size - headerSize);
+	return static_cast<size_t>(_in.gcount()) == size - headerSize;
+      }
+
+    _block.resize(size);
+    if (!_in.read(&_block[headerSize], size - headerSize))
+      {
+	// The writer was cut off part way through this block
+	return false;
+      }
+
+    BlockFile::decode(_block, *batch);
+    return true;
+  }
+}
@@ -0,0 +1,153 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// blockfile.hpp
+
+#include "batch.hpp"
+#include "rotate.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <sys/types.h>
+
+#ifndef blockfile_hpp
+#define blockfile_hpp
+
+namespace Filer
+{
+  /// Fixed size header in front of every block, so a reader can pick
+  /// blocks by time without decoding them
+  struct BlockHeader
+  {
+    uint32_t rows = 0;
+    /// Smallest and largest timemillis in the block
+    long long minTime = 0;
+    long long maxTime = 0;
+    /// Smallest and largest readtime in the block, ns since the epoch
+    long long minRead = 0;
+    long long maxRead = 0;
+  };
+
+  /// Binary file of ammonia samples stored column by column in
+  /// blocks. Times are stored as varint delta of deltas, values with
+  /// Gorilla XOR compression and warmedup as a bitmap. Each block
+  /// names its devices once and stores runs of device indexes
+  class BlockFile
+  {
+  public:
+    /// Magic at the start of every file
+    static const char magic[8];
+
+    /// Encode samples into a block, header included
+    static void encode(const AmmoniaBatch& batch, std::string& out);
+
+    /// Read the header at the start of data. Returns the size of the
+    /// whole block, or 0 if data holds no complete block
+    static size_t header(std::string_view data, BlockHeader& h);
+
+    /// Decode a block, appending its samples to batch
+    static void decode(std::string_view block, AmmoniaBatch& batch);
+  };
+
+  /// File sink writing samples as BlockFile blocks. Samples are held
+  /// until a block is full or old enough, then written and synced
+  class BlockWriter
+  {
+  public:
+    /// Append to path, writing a block every rows samples or once the
+    /// oldest held sample is seconds old. The writer owns rotator, if
+    /// given, and rotates the file when it says to
+    BlockWriter(const std::string& path, size_t rows = 4096,
+		unsigned seconds = 600, Rotator* rotator = NULL);
+    BlockWriter(const BlockWriter& o) = delete;
+
+    /// Write out what is held and close the file
+    ~BlockWriter();
+
+    /// Hold the samples of a batch, writing a block if one is full
+    void write(const AmmoniaBatch& batch);
+
+    /// Write a block if the oldest sample is old enough, and reopen or
+    /// rotate if due. Call regularly from the writing thread
+    void tick();
+
+    /// Write every held sample as a block and sync it
+    void flush();
+
+    /// Ask for the file to be reopened by path on the next write or
+    /// tick. Safe to call from any thread
+    void reopen() {_reopen = 1;};
+
+  private:
+    std::string _path;
+    size_t _rows;
+    unsigned _seconds;
+    int _fd = -1;
+    /// Where to cut the file back to before the next block, if a
+    /// failed write could not be undone at once, or -1
+    off_t _torn = -1;
+    AmmoniaBatch _pending;
+    std::string _block;
+    std::chrono::steady_clock::time_point _oldest;
+    std::atomic<bool> _reopen{0};
+    Rotator* _rotator;
+    void _open();
+    size_t _validate(size_t size);
+    void _rotate();
+  };
+
+  /// Reads the blocks of a BlockFile in order
+  class BlockReader
+  {
+  public:
+    explicit BlockReader(const std::string& path);
+
+    /// Read the next block header, and its samples into batch unless
+    /// batch is NULL. Returns false at the end of the file. Blocks
+    /// that fail their checksum throw
+    bool next(BlockHeader& h, AmmoniaBatch* batch = NULL);
+
+  private:
+    std::string _path;
+    std::ifstream _in;
+    std::string _block;
+  };
+}
+
+#endif
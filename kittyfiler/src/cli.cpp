@@ -42,6 +42,27 @@
 
 namespace Cli
 {
+  std::map<std::string, std::string> splitPairs(const std::string& list)
+  {
+    std::map<std::string, std::string> pairs;
+    size_t start = 0;
+
+    while (start < list.size())
+      {
+	size_t end = list.find(',', start);
+	if (end == std::string::npos) end = list.size();
+
+	std::string item = list.substr(start, end - start);
+	size_t eq = item.find('=');
+	if (eq == std::string::npos) pairs[item] = "";
+	else pairs[item.substr(0, eq)] = item.substr(eq + 1);
+
+	start = end + 1;
+      }
+
+    return pairs;
+  }
+
     Args::Args()
   {
   }
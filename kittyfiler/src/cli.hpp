@@ -46,6 +46,10 @@
 
 namespace Cli
 {
+  /// Split a "key=value,key=value" option argument into a map. A key
+  /// given without a value maps to an empty string
+  std::map<std::string, std::string> splitPairs(const std::string& list);
+
   class Args
   {
   public:
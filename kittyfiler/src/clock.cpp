@@ -0,0 +1,121 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// clock.cpp
+
+#include "clock.hpp"
+
+namespace Filer
+{
+  // A device's clock runs at one millisecond per millisecond give or
+  // take a few percent. Fits outside that are still too noisy to use
+  static const double nominal = 1e-3;
+  static const double tolerance = 0.05;
+
+  ClockEstimator::ClockEstimator(double forget)
+    : _forget(forget)
+  {
+  }
+
+  void ClockEstimator::_learn(Device& d, long long sent, long long read)
+  {
+    // millis() went backwards, so the board reset or rolled over and
+    // what was learned no longer applies
+    if (sent < d.lastSent) d = Device();
+
+    double x = sent;
+    double y = read / 1e9;
+
+    d.w = d.w * _forget + 1;
+    d.sxx *= _forget;
+    d.sxy *= _forget;
+
+    // Weighted Welford update, kept about the mean so the sums never
+    // grow large enough to lose precision
+    double dx = x - d.mx;
+    d.mx += dx / d.w;
+    d.my += (y - d.my) / d.w;
+    d.sxx += dx * (x - d.mx);
+    d.sxy += dx * (y - d.my);
+
+    d.lastSent = sent;
+    d.frames++;
+  }
+
+  double ClockEstimator::_slope(const Device& d)
+  {
+    if (d.frames < 2 || d.sxx <= 0) return nominal;
+
+    double slope = d.sxy / d.sxx;
+    if (slope < nominal * (1 - tolerance) || slope > nominal * (1 + tolerance))
+      return nominal;
+    return slope;
+  }
+
+  void ClockEstimator::estimate(AmmoniaBatch& batch)
+  {
+    Device* d = NULL;
+    std::string_view last;
+
+    for (size_t i = 0; i < batch.size(); i++)
+      {
+	if (!d || batch.device[i] != last)
+	  {
+	    last = batch.device[i];
+	    d = &_devices[last];
+	  }
+
+	// Every sample of a frame shares its sentmillis
+	if (batch.sentmillis[i] != d->lastSent)
+	  _learn(*d, batch.sentmillis[i], batch.readtime[i]);
+
+	double t = d->my + _slope(*d) * (batch.timemillis[i] - d->mx);
+	batch.esttime[i] = t * 1e9;
+      }
+  }
+
+  bool ClockEstimator::fit(std::string_view device, double& slope,
+			   double& intercept)
+  {
+    auto it = _devices.find(device);
+    if (it == _devices.end() || it->second.frames == 0) return 0;
+
+    slope = _slope(it->second);
+    intercept = it->second.my - slope * it->second.mx;
+    return 1;
+  }
+}
@@ -0,0 +1,92 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// clock.hpp
+
+#include "batch.hpp"
+#include <map>
+#include <string_view>
+
+#ifndef clock_hpp
+#define clock_hpp
+
+namespace Filer
+{
+  /// Learns how each device's millis() maps onto host time as frames
+  /// arrive, the same straight line fit kittyview used to make over
+  /// the whole table, so every sample can be stored with its time.
+  /// The fit is recursive least squares kept as a weighted mean and
+  /// co-moments, with older frames slowly forgotten so it follows
+  /// drift. It starts over whenever millis() goes backwards, after a
+  /// reset or rollover
+  class ClockEstimator
+  {
+  public:
+    /// forget is the weight each frame keeps when a newer one arrives
+    explicit ClockEstimator(double forget = 0.999);
+
+    /// Learn from every new frame in batch, in order, and set each
+    /// sample's esttime
+    void estimate(AmmoniaBatch& batch);
+
+    /// The current fit for device, host seconds = intercept + slope
+    /// * millis. Returns 0 if nothing is known about it
+    bool fit(std::string_view device, double& slope, double& intercept);
+
+  private:
+    struct Device
+    {
+      long long lastSent = -1;
+      unsigned long frames = 0;
+      /// Sum of weights, weighted means and co-moments of millis
+      /// and host seconds
+      double w = 0;
+      double mx = 0;
+      double my = 0;
+      double sxx = 0;
+      double sxy = 0;
+    };
+
+    double _forget;
+    std::map<std::string_view, Device> _devices;
+
+    void _learn(Device& d, long long sent, long long read);
+    double _slope(const Device& d);
+  };
+}
+
+#endif
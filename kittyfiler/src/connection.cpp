@@ -38,10 +38,13 @@
 // connection.cpp
 
 #include "connection.hpp"
+#include <cerrno>
 #include <cstring>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <json/json.h>
+#include <memory>
 
 namespace Filer
 {
@@ -101,15 +104,269 @@ namespace Filer
     return 0;
   }
 
+  int Conversion::jsonToBatch(std::string_view frame,
+			      AmmoniaBatch& batch,
+			      const FrameInfo& info,
+			      std::ostream& err)
+  {
+    size_t start = batch.size();
+    try
+      {
+	Json::Value v;
+	Json::CharReaderBuilder builder;
+	std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+	std::string errs;
+
+	if (!reader->parse(frame.data(), frame.data() + frame.size(),
+			   &v, &errs))
+	  {
+	    err << "Failed to parse Json string with " << errs
+		<< std::endl;
+	    return -1;
+	  }
+
+	long long sentmillis = v["sentmillis"].asInt64();
+	const Json::Value& data = v["data"];
+	for (uint i = 0; i < data.size(); i++)
+	  {
+	    const Json::Value& d = data[i];
+	    batch.push(info,
+		       sentmillis,
+		       d["timemillis"].asInt64(),
+		       d["value"].asDouble(),
+		       d["iswarmedup"].asBool());
+	  }
+      }
+    catch (Json::Exception& e)
+      {
+	// Don't leave half a frame behind
+	batch.truncate(start);
+	err << "Failed to parse Json string with "
+	    << e.what() << std::endl;
+	return -1;
+      }
+    return batch.size() - start;
+  }
+
+  FrameBuffer::FrameBuffer(size_t capacity, size_t maxFrame)
+    : _data(new char[capacity]), _capacity(capacity), _maxFrame(maxFrame)
+  {
+  }
+
+  FrameBuffer::FrameBuffer(const FrameBuffer& o)
+    : _data(new char[o._capacity])
+  {
+    _copy(o);
+  }
+
+  FrameBuffer& FrameBuffer::operator=(const FrameBuffer& o)
+  {
+    if (this == &o) return *this;
+
+    char* data = new char[o._capacity];
+    delete [] _data;
+    _data = data;
+    _copy(o);
+    return *this;
+  }
+
+  // Take the unconsumed bytes of o, moved to the front of _data,
+  // which must already hold o's capacity
+  void FrameBuffer::_copy(const FrameBuffer& o)
+  {
+    _capacity = o._capacity;
+    _maxFrame = o._maxFrame;
+    _head = 0;
+    _scan = o._scan - o._head;
+    _tail = o._tail - o._head;
+    _lastAt = 0;
+    _lastSize = 0;
+    _lastStamp = o._lastStamp;
+    _discarding = o._discarding;
+    _discarded = o._discarded;
+    _arrivals.assign(o._arrivals.begin() + o._arrival, o._arrivals.end());
+    _arrival = 0;
+
+    memcpy(_data, o._data + o._head, _tail);
+    for (auto it = _arrivals.begin(); it != _arrivals.end(); it++)
+      it->end -= o._head;
+  }
+
+  FrameBuffer::~FrameBuffer()
+  {
+    delete [] _data;
+  }
+
+  // Make room for n more bytes after the tail, first by sliding the
+  // unconsumed bytes to the front, then by growing the buffer
+  void FrameBuffer::_reserve(size_t n)
+  {
+    if (_capacity - _tail >= n) return;
+
+    if (_head > 0)
+      {
+	memmove(_data, _data + _head, _tail - _head);
+	_arrivals.erase(_arrivals.begin(), _arrivals.begin() + _arrival);
+	_arrival = 0;
+	for (auto it = _arrivals.begin(); it != _arrivals.end(); it++)
+	  it->end -= _head;
+	_scan -= _head;
+	_tail -= _head;
+	_head = 0;
+      }
+
+    if (_capacity - _tail < n)
+      {
+	size_t ncap = _capacity * 2;
+	while (ncap - _tail < n) ncap *= 2;
+	char* ndata = new char[ncap];
+	memcpy(ndata, _data, _tail);
+	delete [] _data;
+	_data = ndata;
+	_capacity = ncap;
+      }
+  }
+
+  ssize_t FrameBuffer::fill(int fd)
+  {
+    // Always read at least a quarter buffer at a time
+    _reserve(_capacity / 4);
+    ssize_t code = read(fd, _data + _tail, _capacity - _tail);
+
+    // As close to the bytes arriving as can be seen from here
+    return _filled(code, Stamp::now());
+  }
+
+  ssize_t FrameBuffer::fill(int fd, const Stamp& at)
+  {
+    _reserve(_capacity / 4);
+    return _filled(read(fd, _data + _tail, _capacity - _tail), at);
+  }
+
+  ssize_t FrameBuffer::_filled(ssize_t code, const Stamp& at)
+  {
+    _lastAt = _tail;
+    _lastSize = code > 0 ? code : 0;
+    if (code > 0) _arrived(code, at);
+    return code;
+  }
+
+  void FrameBuffer::write(const char* data, size_t n)
+  {
+    write(data, n, Stamp::now());
+  }
+
+  void FrameBuffer::write(const char* data, size_t n, const Stamp& at)
+  {
+    _reserve(n);
+    memcpy(_data + _tail, data, n);
+    _lastAt = _tail;
+    _lastSize = n;
+    _arrived(n, at);
+  }
+
+  void FrameBuffer::_arrived(size_t n, const Stamp& at)
+  {
+    _tail += n;
+    _lastStamp = at;
+    _arrivals.push_back({_tail, at});
+  }
+
+  bool FrameBuffer::next(std::string_view& frame, char eor)
+  {
+    Stamp arrived;
+    return next(frame, eor, arrived);
+  }
+
+  bool FrameBuffer::next(std::string_view& frame, char eor, Stamp& arrived)
+  {
+    for (;;)
+      {
+	// Only scan bytes that have not been searched before
+	const char* end = static_cast<const char*>
+	  (memchr(_data + _scan, eor, _tail - _scan));
+
+	if (!end)
+	  {
+	    _scan = _tail;
+
+	    // A device that never sends the terminator would grow the
+	    // buffer without end, so past the limit throw the bytes
+	    // away and skip on to the next terminator
+	    if (_tail - _head > _maxFrame)
+	      {
+		_discarded += _tail - _head;
+		clear();
+		_discarding = 1;
+	      }
+	    return 0;
+	  }
+
+	size_t start = _head;
+	size_t fend = end - _data + 1;
+	_head = fend;
+	_scan = fend;
+
+	// The terminator came in with the first fill ending after it
+	while (_arrivals[_arrival].end < fend) _arrival++;
+	Stamp at = _arrivals[_arrival].at;
+
+	// Rewind to the front for free when everything is consumed.
+	// The bytes stay put, so the frame is still valid
+	if (_head == _tail)
+	  {
+	    _head = _scan = _tail = 0;
+	    _arrivals.clear();
+	    _arrival = 0;
+	  }
+
+	// The tail of an overlong frame, or one that fit in the buffer
+	// whole but is still too long
+	if (_discarding || fend - start > _maxFrame)
+	  {
+	    _discarded += fend - start;
+	    _discarding = 0;
+	    continue;
+	  }
+
+	frame = std::string_view(_data + start, fend - start);
+	arrived = at;
+	return 1;
+      }
+  }
+
+  void FrameBuffer::clear()
+  {
+    _head = _scan = _tail = 0;
+    _arrivals.clear();
+    _arrival = 0;
+    _discarding = 0;
+  }
+
+  // Put the port in raw mode. The port is opened non-blocking and
+  // reads return whatever has arrived at once, so one quiet device
+  // can't hold up the poll loop serving the others
   void Connection::_setDefaultOptions()
   {
     if (_fd)
       {
-	_portSettings.c_cflag &= ~CRTSCTS;
-	_portSettings.c_cflag |= CREAD | CLOCAL;
-	_portSettings.c_iflag &= ~(IXON | IXOFF | IXANY);
-	_portSettings.c_iflag &= ~(ICANON | ECHO | ECHOE | ISIG);
-	tcsetattr(fd(), TCSANOW, &_portSettings);
+	_portSettings.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP
+				   | INLCR | IGNCR | ICRNL
+				   | IXON | IXOFF | IXANY);
+	_portSettings.c_oflag &= ~OPOST;
+	_portSettings.c_lflag &= ~(ICANON | ECHO | ECHOE | ECHONL
+				   | ISIG | IEXTEN);
+	_portSettings.c_cflag &= ~(CSIZE | PARENB | CRTSCTS);
+	_portSettings.c_cflag |= CS8 | CREAD | CLOCAL;
+	_portSettings.c_cc[VMIN] = 0;
+	_portSettings.c_cc[VTIME] = 0;
+	if (tcsetattr(fd(), TCSANOW, &_portSettings) < 0)
+	  {
+	    _lastError = errno;
+	    std::string e = "Failed to config port: ";
+	    e += getErrorString();
+	    throw std::runtime_error(e);
+	  }
       }
     else throw std::runtime_error("Failed to config, port not open");
   }
@@ -118,12 +375,17 @@ namespace Filer
 			 speed_t baud)
     : _special(special)
   {
+    std::string_view name(special);
+    size_t slash = name.find_last_of('/');
+    if (slash != std::string_view::npos) name.remove_prefix(slash + 1);
+    _device = AmmoniaBatch::intern(name);
+
     init(baud);
   }
 
   Connection::Connection(Connection& o)
-    : _special(o._special), _fd(new int),
-      _portSettings(o._portSettings)
+    : _special(o._special), _device(o._device), _fd(new int),
+      _portSettings(o._portSettings), _buffer(o._buffer)
   {
     *_fd = o.fd();;
   }
@@ -131,7 +393,6 @@ namespace Filer
   Connection::~Connection()
   {
     if (_fd) closePort();
-    delete _fd;
   }
 
   void Connection::init(speed_t baud)
@@ -152,7 +413,7 @@ namespace Filer
   // Copy current configuration of port to struct
   void Connection::getPortConfig()
   {
-    if (!_fd) tcgetattr(*_fd, &_portSettings);
+    if (_fd) tcgetattr(*_fd, &_portSettings);
     else throw std::runtime_error("File not open");
   }
 
@@ -161,12 +422,15 @@ namespace Filer
   {
     if (!_fd) _fd = new int;
     else throw std::runtime_error("File already open");
-    *_fd = open(_special, O_RDWR | O_NOCTTY);
+    *_fd = open(_special, O_RDWR | O_NOCTTY | O_NONBLOCK);
     if (*_fd < 0)
       {
+	delete _fd;
 	_fd = NULL;
 	throw std::runtime_error("Could not connect to port");
       }
+    getPortConfig();
+    _buffer.clear();
   }
 
   void Connection::closePort()
@@ -174,17 +438,18 @@ namespace Filer
     if (_fd)
       {
 	close(*_fd);
+	delete _fd;
 	_fd = NULL;
       }
   }
 
-  inline bool Connection::isOpen()
+  bool Connection::isOpen()
   {
     if (_fd) return 1;
     else return 0;
   }
 
-  inline int Connection::fd()
+  int Connection::fd()
   {
     if (_fd) return *_fd;
     else return -1;
@@ -204,34 +469,67 @@ namespace Filer
 
   int Connection::readUntil(std::ostream& buffer, char eor)
   {
-    if (_fd)
+    std::string_view frame;
+    size_t counter = readFrame(frame, eor);
+    buffer.write(frame.data(), counter);
+    return counter;
+  }
+
+  size_t Connection::readFrame(std::string_view& frame, char eor)
+  {
+    while (!_buffer.next(frame, eor))
       {
-	char b[1] = {'\0'};
-	int counter = 0;
-	ssize_t code = 1;
+	ssize_t code = fill();
+	if (code == 0) return 0;
+	if (code > 0) continue;
 
-	while (b[0] != eor || code > 0)
+	// Nothing waiting on the non-blocking port, sleep until there is
+	struct pollfd p = {fd(), POLLIN, 0};
+	if (poll(&p, 1, -1) < 0 && errno != EINTR)
 	  {
-	    code = read(fd(), b, 1);
-
-	    if (code < 0)
-	      {
-		_lastError = errno;
-		std::string e = "Read error: ";
-		e += getErrorString();
-		throw std::runtime_error(e);
-	      }
-	    if (code > 0)
-	      {
-		buffer << b[0];
-		counter++;
-	      }
+	    _lastError = errno;
+	    std::string e = "Poll error: ";
+	    e += getErrorString();
+	    throw std::runtime_error(e);
 	  }
-	return counter;
       }
+
+    return frame.size();
+  }
+
+  ssize_t Connection::fill()
+  {
+    if (_fd) return _readResult(_buffer.fill(fd()));
+    else throw std::runtime_error("File not open");
+  }
+
+  ssize_t Connection::fill(const Stamp& at)
+  {
+    if (_fd) return _readResult(_buffer.fill(fd(), at));
     else throw std::runtime_error("File not open");
   }
 
+  // Nothing waiting on the non-blocking port is not an error
+  ssize_t Connection::_readResult(ssize_t code)
+  {
+    if (code < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return -1;
+
+    if (code < 0)
+      {
+	_lastError = errno;
+	std::string e = "Read error: ";
+	e += getErrorString();
+	throw std::runtime_error(e);
+      }
+    return code;
+  }
+
+  bool Connection::nextFrame(std::string_view& frame, char eor)
+  {
+    return _buffer.next(frame, eor);
+  }
+
   std::string Connection::getErrorString()
   {
     return std::string(strerror(_lastError));
@@ -38,8 +38,11 @@
 // connection.hpp
 
 #include <iostream>
+#include <vector>
+#include <string_view>
 #include <termios.h>
 #include <json/json.h>
+#include "batch.hpp"
 
 #ifndef CONNECTION_HPP
 #define CONNECTION_HPP
@@ -57,15 +60,106 @@ namespace Filer
 			 std::ostream& ofile,
 			 const std::string& readtime,
 			 std::ostream& err = std::cerr);
+
+    /// Parse a frame straight into batch, stamping every sample with
+    /// info. Returns samples added, or -1 if the frame is bad
+    static int jsonToBatch(std::string_view frame,
+			   AmmoniaBatch& batch,
+			   const FrameInfo& info,
+			   std::ostream& err = std::cerr);
+  };
+
+  /// Reusable read buffer that reads in large chunks and splits the
+  /// received bytes into terminated frames. Frames longer than
+  /// maxFrame are thrown away rather than buffered
+  class FrameBuffer
+  {
+  public:
+    explicit FrameBuffer(size_t capacity = 4096, size_t maxFrame = 65536);
+    FrameBuffer(const FrameBuffer& o);
+    FrameBuffer& operator=(const FrameBuffer& o);
+    ~FrameBuffer();
+
+    /// Read as many bytes as fit from fd, stamping them with the
+    /// time read() returned. Returns the read() result
+    ssize_t fill(int fd);
+
+    /// As fill, stamping the bytes with at, the time fd was seen to
+    /// be readable
+    ssize_t fill(int fd, const Stamp& at);
+
+    /// Copy n bytes from data into the buffer, growing it if needed,
+    /// stamped as arriving now
+    void write(const char* data, size_t n);
+
+    /// Copy n bytes from data into the buffer, stamped as arriving at
+    void write(const char* data, size_t n, const Stamp& at);
+
+    /// Point frame at the next complete frame ending in eor,
+    /// terminator included. The view is valid until the next fill
+    /// or write. Returns 0 if no complete frame is buffered
+    bool next(std::string_view& frame, char eor);
+
+    /// As next, also setting arrived to when the frame's terminator
+    /// was read
+    bool next(std::string_view& frame, char eor, Stamp& arrived);
+
+    /// Number of received bytes not yet returned as a frame
+    size_t pending() const {return _tail - _head;};
+
+    /// The bytes added by the last fill or write. Valid until the
+    /// next fill or write
+    std::string_view last() const
+    {return std::string_view(_data + _lastAt, _lastSize);};
+
+    /// When the bytes of the last fill or write arrived
+    const Stamp& lastStamp() const {return _lastStamp;};
+
+    /// Bytes thrown away so far as part of overlong frames
+    unsigned long long discarded() const {return _discarded;};
+
+    /// Drop all buffered bytes
+    void clear();
+
+  private:
+    char* _data;
+    size_t _capacity;
+    size_t _maxFrame;
+    size_t _head = 0;
+    size_t _scan = 0;
+    size_t _tail = 0;
+    size_t _lastAt = 0;
+    size_t _lastSize = 0;
+    Stamp _lastStamp;
+    bool _discarding = 0;
+    unsigned long long _discarded = 0;
+
+    /// Where the bytes of each fill or write still buffered end, and
+    /// when they arrived, oldest first
+    struct Arrival
+    {
+      size_t end;
+      Stamp at;
+    };
+    std::vector<Arrival> _arrivals;
+    size_t _arrival = 0;
+
+    void _copy(const FrameBuffer& o);
+    void _reserve(size_t n);
+    ssize_t _filled(ssize_t code, const Stamp& at);
+    void _arrived(size_t n, const Stamp& at);
   };
 
   class Connection
   {
   private:
     const char* _special;
-    int* _fd;
+    std::string_view _device;
+    int* _fd = NULL;
     struct termios _portSettings;
+    FrameBuffer _buffer;
     void _setDefaultOptions();
+    ssize_t _readResult(ssize_t code);
     int _lastError = 0;
 
   protected:
@@ -85,7 +179,24 @@ namespace Filer
     /// Read port to ostream until the given null-terminated characters
     /// Returns 0 if EOF is reached before characters
     int readUntil(std::ostream& buffer, char eor);
+    /// Block until a frame ending in eor is buffered and point frame
+    /// at it. Returns frame length, or 0 if EOF is reached first
+    size_t readFrame(std::string_view& frame, char eor);
+    /// Read whatever is available on the port into the frame buffer
+    /// without waiting. Returns bytes read, 0 on EOF, or -1 if
+    /// nothing has arrived
+    ssize_t fill();
+    /// As fill, stamping what is read with at rather than the time
+    /// the read returned
+    ssize_t fill(const Stamp& at);
+    /// Take the next buffered frame without reading the port
+    bool nextFrame(std::string_view& frame, char eor);
+    /// The buffer fill reads into
+    FrameBuffer& buffer() {return _buffer;};
     std::string getErrorString();
+    /// Name used to tell this device's rows apart, the base name of
+    /// the special file
+    std::string_view device() {return _device;};
   };
 }
 
@@ -0,0 +1,199 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// csvwriter.cpp
+
+#include "csvwriter.hpp"
+#include "cli.hpp"
+#include "trace.hpp"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace Filer
+{
+  void CsvWriter::parsePolicy(const std::string& spec, policy& p,
+			      size_t& every)
+  {
+    std::map<std::string, std::string> pairs = Cli::splitPairs(spec);
+
+    if (pairs.size() == 1 && pairs.count("frame"))
+      {
+	p = FRAME;
+	every = 0;
+	return;
+      }
+
+    if (pairs.size() == 1 && pairs.count("ms"))
+      {
+	p = INTERVAL;
+	every = std::stoul(pairs["ms"]);
+	return;
+      }
+
+    if (pairs.size() == 1 && pairs.count("bytes"))
+      {
+	p = SIZE;
+	every = std::stoul(pairs["bytes"]);
+	return;
+      }
+
+    std::string err = "In Filer::CsvWriter::parsePolicy: ";
+    err += "Unknown flush policy ";
+    err += spec;
+    throw std::runtime_error(err);
+  }
+
+  CsvWriter::CsvWriter(const std::string& path, policy p, size_t every,
+		       Rotator* rotator)
+    :_path(path), _policy(p), _every(every), _rotator(rotator)
+  {
+    _buffer.reserve(p == SIZE && every > (1 << 20) ? every : 1 << 20);
+    _open();
+  }
+
+  CsvWriter::~CsvWriter()
+  {
+    try
+      {
+	flush();
+      }
+    catch (std::exception& e)
+      {
+      }
+
+    if (_fd >= 0) close(_fd);
+    delete _rotator;
+  }
+
+  void CsvWriter::_open()
+  {
+    _fd = open(_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+	       0644);
+
+    if (_fd < 0)
+      {
+	std::string err = "In Filer::CsvWriter::_open: ";
+	err += "Could not open " + _path + ": ";
+	err += strerror(errno);
+	throw std::runtime_error(err);
+      }
+  }
+
+  void CsvWriter::write(const AmmoniaBatch& batch)
+  {
+    if (batch.empty()) return;
+
+    if (_buffer.empty()) _oldest = std::chrono::steady_clock::now();
+    batch.appendCSV(_buffer);
+    if (_rotator) _rotator->saw(batch);
+
+    if (_policy == FRAME
+	|| (_policy == SIZE && _buffer.size() >= _every))
+      flush();
+    tick();
+  }
+
+  void CsvWriter::tick()
+  {
+    if (_reopen)
+      {
+	// Rows buffered so far belong in the old file
+	flush();
+	close(_fd);
+	_fd = -1;
+	_reopen = 0;
+	_open();
+	return;
+      }
+
+    if (_rotator && _rotator->due()) _rotate();
+
+    if (_policy != INTERVAL || _buffer.empty()) return;
+
+    auto age = std::chrono::steady_clock::now() - _oldest;
+    if (age >= std::chrono::milliseconds(_every)) flush();
+  }
+
+  void CsvWriter::flush()
+  {
+    if (_buffer.empty()) return;
+
+    TraceSpan span("csv flush", "bytes", _buffer.size());
+
+    size_t done = 0;
+    while (done < _buffer.size())
+      {
+	ssize_t n = ::write(_fd, _buffer.data() + done,
+			    _buffer.size() - done);
+	if (n < 0 && errno == EINTR) continue;
+	if (n < 0)
+	  {
+	    // Keep what didn't make it for the next try
+	    _buffer.erase(0, done);
+	    std::string err = "In Filer::CsvWriter::flush: ";
+	    err += "Could not write " + _path + ": ";
+	    err += strerror(errno);
+	    throw std::runtime_error(err);
+	  }
+	done += n;
+      }
+
+    if (_rotator) _rotator->wrote(_buffer.size());
+    _buffer.clear();
+
+    if (fsync(_fd) < 0)
+      {
+	std::string err = "In Filer::CsvWriter::flush: ";
+	err += "Could not sync " + _path + ": ";
+	err += strerror(errno);
+	throw std::runtime_error(err);
+      }
+  }
+
+  // Close off the active file and start a new one in its place
+  void CsvWriter::_rotate()
+  {
+    flush();
+    close(_fd);
+    _fd = -1;
+    _rotator->rotate();
+    _open();
+  }
+}
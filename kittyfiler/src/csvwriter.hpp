@@ -0,0 +1,109 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// csvwriter.hpp
+
+#include "batch.hpp"
+#include "rotate.hpp"
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#ifndef csvwriter_hpp
+#define csvwriter_hpp
+
+namespace Filer
+{
+  /// CSV file kept open for the life of the program. Rows collect in
+  /// memory and reach the disk, synced, only as often as the flush
+  /// policy asks
+  class CsvWriter
+  {
+  public:
+    /// When buffered rows are written out and synced
+    enum policy
+      {
+	FRAME,    ///< After every frame
+	INTERVAL, ///< Once the oldest unsynced row is every ms old
+	SIZE      ///< Once every bytes are buffered
+      };
+
+    /// Parse a policy: frame, ms=<N> or bytes=<N>
+    static void parsePolicy(const std::string& spec, policy& p,
+			    size_t& every);
+
+    /// Open path for appending. The writer owns rotator, if given,
+    /// and rotates the file when it says to
+    CsvWriter(const std::string& path, policy p = INTERVAL,
+	      size_t every = 1000, Rotator* rotator = NULL);
+    CsvWriter(const CsvWriter& o) = delete;
+
+    /// Flush, sync and close the file
+    ~CsvWriter();
+
+    /// Buffer the rows of a batch, flushing if the policy says so
+    void write(const AmmoniaBatch& batch);
+
+    /// Flush on an elapsed interval, and reopen or rotate if due. Call
+    /// regularly from the writing thread
+    void tick();
+
+    /// Write out everything buffered and sync it to disk
+    void flush();
+
+    /// Ask for the file to be closed and opened again by path on the
+    /// next write or tick, once logrotate has moved it. Safe to call
+    /// from any thread
+    void reopen() {_reopen = 1;};
+
+    const std::string& path() {return _path;};
+
+  private:
+    std::string _path;
+    policy _policy;
+    size_t _every;
+    int _fd = -1;
+    std::string _buffer;
+    std::chrono::steady_clock::time_point _oldest;
+    std::atomic<bool> _reopen{0};
+    Rotator* _rotator;
+    void _open();
+    void _rotate();
+  };
+}
+
+#endif
@@ -38,10 +38,24 @@
 // database.cpp
 
 #include "database.hpp"
+#include "schema.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
 #include <pqxx/pqxx>
+#include <memory>
+#include <optional>
+#include <stdexcept>
 
 namespace Filer
 {
+  const Database::svector Database::_ammoniaColumns =
+    {"sentmillis", "timemillis", "value", "warmedup", "readtime",
+     "device", "esttime"};
+
+  const Database::svector Database::_compactColumns =
+    {"sentmillis", "timemillis", "counts", "warmedup", "readtime",
+     "device", "esttime"};
+
   Database::Database()
   {
   }
@@ -51,6 +65,11 @@ namespace Filer
     init(a);
   }
 
+  Database::~Database()
+  {
+    _disconnect();
+  }
+
   void Database::init(auth* a)
   {
     if (_auth) clear();
@@ -59,22 +78,111 @@ namespace Filer
 
   void Database::clear()
   {
+    _disconnect();
     if (_auth) _auth = NULL;
   }
 
-  int Database::append(const std::string& table, std::istream& data)
+  void Database::prepare(const std::string& name,
+			 const std::string& query)
   {
-    if (!tableExists(table))
+    _prepared[name] = query;
+    if (_con) _con->prepare(name, query);
+  }
+
+  bool Database::isConnected()
+  {
+    return _con && _con->is_open();
+  }
+
+  // Return the held connection, opening a new one if there is none
+  // or the old one has dropped
+  pqxx::connection& Database::_connection()
+  {
+    if (_con && !_con->is_open()) _disconnect();
+
+    if (!_con)
       {
-	std::string e;
-	e += "In Database::append: Table ";
-	e += table;
-	e += " does not exist.";
-	throw std::runtime_error(e);
+	if (!_auth)
+	  throw std::runtime_error("In Database::_connection: No auth set");
+
+	_con = new pqxx::connection(conString());
+
+	// Statements only live as long as the connection
+	for (auto it = _prepared.begin(); it != _prepared.end(); it++)
+	  _con->prepare(it->first, it->second);
       }
-    pqxx::connection c(_conString());
-    pqxx::work w(c);
-    std::vector<svector> dv;
+
+    return *_con;
+  }
+
+  void Database::_disconnect()
+  {
+    delete _con;
+    _con = NULL;
+  }
+
+  // Run f on the held connection. If the connection turns out to be
+  // broken, reconnect and try once more
+  void Database::_withConnection
+  (const std::function<void(pqxx::connection&)>& f)
+  {
+    try
+      {
+	f(_connection());
+      }
+    catch (pqxx::in_doubt_error& e)
+      {
+	// Can't tell if the commit went through, so don't repeat it
+	_disconnect();
+	throw;
+      }
+    catch (pqxx::broken_connection& e)
+      {
+	metrics().reconnects.add();
+	_disconnect();
+	f(_connection());
+      }
+  }
+
+  bool Database::refused(const std::exception& e)
+  {
+    if (dynamic_cast<const std::range_error*>(&e)) return 1;
+
+    const pqxx::sql_error* sql = dynamic_cast<const pqxx::sql_error*>(&e);
+    if (!sql) return 0;
+
+    const std::string& state = sql->sqlstate();
+    return state.compare(0, 2, "22") == 0 || state.compare(0, 2, "23") == 0;
+  }
+
+  bool Database::duplicate(const std::exception& e)
+  {
+    const pqxx::sql_error* sql = dynamic_cast<const pqxx::sql_error*>(&e);
+    return sql && sql->sqlstate() == "23505";
+  }
+
+  void Database::setIngest(ingest mode)
+  {
+    _ingest = mode;
+  }
+
+  Database::ingest Database::ingestMode()
+  {
+    return _ingest;
+  }
+
+  void Database::setLayout(layout l)
+  {
+    _layout = l;
+  }
+
+  Database::layout Database::rowLayout()
+  {
+    return _layout;
+  }
+
+  int Database::parseCSV(std::istream& data, std::vector<svector>& dv)
+  {
     dv.push_back(svector(1));
 
     // Parse the incoming stream
@@ -92,33 +200,57 @@ namespace Filer
 	    data.get(s);
 	  }
 	if (!data.eof()) dv.push_back(svector(1));
-	// data.get(s);
       }
 
     // If an empty element is still on the vector, remove it
     if (dv.back().at(0).empty()) dv.pop_back();
 
-    for (auto it = dv.begin(); it != dv.end(); it++)
-      {
-	svector& sdv = *it;
-	// Define the insert query
-	std::string query;
-	query += "INSERT INTO ";
-	query += table;
-	query += " VALUES (";
-	for (auto itt = sdv.begin(); itt != sdv.end(); itt++)
-	  {
-	    query += "'";
-	    query += *itt;
-	    query += "'";
-	    if (itt != sdv.end() -1) query += ',';
-	  }
-	query += ")";
+    return dv.size();
+  }
 
-	// Perform the query
-	w.exec(query);
+  int Database::append(const std::string& table, std::istream& data)
+  {
+    if (!tableExists(table))
+      {
+	std::string e;
+	e += "In Database::append: Table ";
+	e += table;
+	e += " does not exist.";
+	throw std::runtime_error(e);
       }
-    w.commit();
+    std::vector<svector> dv;
+    parseCSV(data, dv);
+
+    if (_ingest == COPY) return _copy(table, dv, svector());
+
+    _withConnection([&](pqxx::connection& c)
+    {
+      pqxx::work w(c);
+
+      for (auto it = dv.begin(); it != dv.end(); it++)
+	{
+	  svector& sdv = *it;
+	  // Define the insert query
+	  std::string query;
+	  query += "INSERT INTO ";
+	  query += table;
+	  query += " VALUES (";
+	  for (auto itt = sdv.begin(); itt != sdv.end(); itt++)
+	    {
+	      query += "'";
+	      query += *itt;
+	      query += "'";
+	      if (itt != sdv.end() -1) query += ',';
+	    }
+	  query += ")";
+
+	  // Perform the query
+	  TraceSpan span("INSERT");
+	  w.exec(query);
+	}
+      TraceSpan span("COMMIT");
+      w.commit();
+    });
 
     // Return number of rows sent
     return dv.size();
@@ -135,86 +267,371 @@ namespace Filer
 	e += " does not exist.";
 	throw std::runtime_error(e);
       }
-    pqxx::connection c(_conString());
-    pqxx::work w(c);
     std::vector<svector> dv;
-    dv.push_back(svector(1));
+    parseCSV(data, dv);
 
-    // Parse the incoming stream
-    while (!data.eof())
+    if (_ingest == COPY) return _copy(table, dv, headers);
+
+    _withConnection([&](pqxx::connection& c)
+    {
+      pqxx::work w(c);
+
+      for (auto it = dv.begin(); it != dv.end(); it++)
+	{
+	  svector& sdv = *it;
+	  // Define the insert query
+	  std::string query;
+	  query += "INSERT INTO ";
+	  query += table;
+	  query += " (";
+	  for (auto itt = headers.begin(); itt != headers.end(); itt++)
+	    {
+	      query += *itt;
+	      if (itt != headers.end() -1) query += ',';
+	    }
+	  query += ")";
+	  query += " VALUES (";
+	  for (auto itt = sdv.begin(); itt != sdv.end(); itt++)
+	    {
+	      query += "'";
+	      query += *itt;
+	      query += "'";
+	      if (itt != sdv.end() -1) query += ',';
+	    }
+	  query += ")";
+
+	  // Perform the query
+	  TraceSpan span("INSERT");
+	  w.exec(query);
+	}
+      TraceSpan span("COMMIT");
+      w.commit();
+    });
+
+    // Return number of rows sent
+    return dv.size();
+  }
+
+  int Database::append(const std::string& table,
+		       const AmmoniaBatch& batch)
+  {
+    StageTimer timer(metrics().db);
+
+    if (!tableExists(table))
       {
-	char s = '\0';
-	char sep = ',';
-	svector& sdv = dv.back();
-	while (s != '\n' && !data.eof())
+	std::string e;
+	e += "In Database::append: Table ";
+	e += table;
+	e += " does not exist.";
+	throw std::runtime_error(e);
+      }
+
+    if (batch.empty()) return 0;
+
+    if (_ingest == COPY && _layout == COMPACT)
+      {
+	_withConnection([&](pqxx::connection& c)
+	{
+	  pqxx::work w(c);
 	  {
-	    if (s == '\0') data.get(s);
-	    if (s != sep && s != '\n' && s != '\0')
-	      sdv.back().push_back(s);
-	    else if (s == sep) sdv.push_back("");
-	    data.get(s);
+	    TraceSpan span("COPY", "rows", batch.size());
+	    pqxx::stream_to s(w, table, _compactColumns);
+
+	    for (size_t i = 0; i < batch.size(); i++)
+	      {
+		std::optional<long long> est;
+		if (batch.esttime[i]) est = batch.esttime[i] / 1000;
+
+		s.write_values(batch.sentmillis[i], batch.timemillis[i],
+			       AmmoniaBatch::counts(batch.value[i]),
+			       bool(batch.warmedup[i]),
+			       batch.readtime[i] / 1000, batch.device[i], est);
+	      }
+	    s.complete();
 	  }
-	if (!data.eof()) dv.push_back(svector(1));
-	// data.get(s);
-      }
+	  TraceSpan span("COMMIT");
+	  w.commit();
+	});
 
-    // If an empty element is still on the vector, remove it
-    if (dv.back().at(0).empty()) dv.pop_back();
+	return batch.size();
+      }
 
-    for (auto it = dv.begin(); it != dv.end(); it++)
+    if (_ingest == COPY)
       {
-	svector& sdv = *it;
-	// Define the insert query
-	std::string query;
-	query += "INSERT INTO ";
-	query += table;
-	query += " (";
-	for (auto itt = headers.begin(); itt != headers.end(); itt++)
+	_withConnection([&](pqxx::connection& c)
+	{
+	  pqxx::work w(c);
 	  {
-	    query += *itt;
-	    if (itt != headers.end() -1) query += ',';
+	    TraceSpan span("COPY", "rows", batch.size());
+	    pqxx::stream_to s(w, table, _ammoniaColumns);
+
+	    for (size_t i = 0; i < batch.size(); i++)
+	      {
+		std::optional<std::string> est;
+		if (batch.esttime[i])
+		  est = AmmoniaBatch::isoTimestamp(batch.esttime[i]);
+
+		s.write_values(batch.sentmillis[i], batch.timemillis[i],
+			       batch.value[i], bool(batch.warmedup[i]),
+			       AmmoniaBatch::isoTimestamp(batch.readtime[i]),
+			       batch.device[i], est);
+	      }
+	    s.complete();
 	  }
-	query += ")";
-	query += " VALUES (";
-	for (auto itt = sdv.begin(); itt != sdv.end(); itt++)
+	  TraceSpan span("COMMIT");
+	  w.commit();
+	});
+
+	return batch.size();
+      }
+
+    if (_layout == COMPACT)
+      {
+	std::string stmt = "append_compact:" + table;
+	if (!_prepared.count(stmt))
 	  {
-	    query += "'";
-	    query += *itt;
-	    query += "'";
-	    if (itt != sdv.end() -1) query += ',';
+	    std::string query;
+	    query += "INSERT INTO ";
+	    query += table;
+	    query += " (sentmillis,timemillis,counts,warmedup,readtime,device,";
+	    query += "esttime) VALUES ($1::bigint, $2::bigint, $3::smallint,";
+	    query += " $4::bool, $5::bigint, $6::text, nullif($7::bigint, 0))";
+	    query += " ON CONFLICT DO NOTHING";
+	    prepare(stmt, query);
 	  }
-	query += ")";
 
-	// Perform the query
-	w.exec(query);
+	_withConnection([&](pqxx::connection& c)
+	{
+	  pqxx::work w(c);
+
+	  for (size_t i = 0; i < batch.size(); i++)
+	    {
+	      TraceSpan span("INSERT", "row", i);
+	      w.exec_prepared(stmt, batch.sentmillis[i], batch.timemillis[i],
+			      AmmoniaBatch::counts(batch.value[i]),
+			      bool(batch.warmedup[i]), batch.readtime[i] / 1000,
+			      batch.device[i], batch.esttime[i] / 1000);
+	    }
+	  TraceSpan span("COMMIT");
+	  w.commit();
+	});
+
+	return batch.size();
+      }
+
+    // Prepare on first use. The server keeps the plan, so each row
+    // only carries its values. readtime goes as text, the same as
+    // COPY and the pipelined INSERT send it, so a sample sent again
+    // by another path matches the table's key
+    std::string stmt = "append_ammonia:" + table;
+    if (!_prepared.count(stmt))
+      {
+	std::string query;
+	query += "INSERT INTO ";
+	query += table;
+	query += " (sentmillis,timemillis,value,warmedup,readtime,device,";
+	query += "esttime) VALUES ($1::bigint, $2::bigint, $3::numeric,";
+	query += " $4::bool, $5::timestamptz, $6::text,";
+	query += " to_timestamp(nullif($7::float8, 0)))";
+	query += " ON CONFLICT DO NOTHING";
+	prepare(stmt, query);
+      }
+
+    _withConnection([&](pqxx::connection& c)
+    {
+      pqxx::work w(c);
+
+      for (size_t i = 0; i < batch.size(); i++)
+	{
+	  TraceSpan span("INSERT", "row", i);
+	  w.exec_prepared(stmt, batch.sentmillis[i], batch.timemillis[i],
+			  batch.value[i], bool(batch.warmedup[i]),
+			  AmmoniaBatch::isoTimestamp(batch.readtime[i]),
+			  batch.device[i], batch.esttime[i] / 1e9);
+	}
+      TraceSpan span("COMMIT");
+      w.commit();
+    });
+
+    // Return number of rows sent
+    return batch.size();
+  }
+
+  // Stream all rows to the server in a single COPY FROM STDIN. An
+  // empty header list copies into every column in table order
+  int Database::_copy(const std::string& table,
+		      const std::vector<svector>& dv,
+		      const svector& headers)
+  {
+    _withConnection([&](pqxx::connection& c)
+    {
+      pqxx::work w(c);
+      std::unique_ptr<pqxx::stream_to> s;
+
+      if (headers.empty()) s.reset(new pqxx::stream_to(w, table));
+      else s.reset(new pqxx::stream_to(w, table, headers));
+
+      {
+	TraceSpan span("COPY", "rows", dv.size());
+	for (auto it = dv.begin(); it != dv.end(); it++)
+	  s->write_row(*it);
+	s->complete();
+	s.reset();
       }
-    w.commit();
+      TraceSpan span("COMMIT");
+      w.commit();
+    });
 
     // Return number of rows sent
     return dv.size();
   }
 
+  int Database::upsert(const std::string& table, const std::string& source,
+		      long long width,
+		      const std::vector<RollupBucket>& buckets)
+  {
+    if (buckets.empty()) return 0;
+
+    // Each bucket is summed from what the sample table holds, so
+    // sending one again, or samples stored twice, change nothing.
+    // Bounds are microseconds since the epoch, how the compact table
+    // keeps its times
+    std::string stmt = "upsert_rollup:" + table + ":" + source;
+    if (!_prepared.count(stmt))
+      {
+	std::string v = "value::float8";
+	std::string t = "coalesce(esttime, readtime)";
+	std::string from = "to_timestamp($2::bigint / 1e6)";
+	std::string to = "to_timestamp($3::bigint / 1e6)";
+	std::string last = "max(t)";
+
+	if (_layout == COMPACT)
+	  {
+	    v = "counts::float8";
+	    from = "$2::bigint";
+	    to = "$3::bigint";
+	    last = "to_timestamp(max(t) / 1e6)";
+	  }
+
+	std::string query;
+	query += "INSERT INTO ";
+	query += table;
+	query += " AS r (device,bucket,min,max,sum,count,last,lasttime)";
+	query += " SELECT $1::text, to_timestamp($2::bigint / 1e6), min(v),";
+	query += " max(v), sum(v), count(*),";
+	query += " (array_agg(v ORDER BY t DESC))[1], " + last;
+	query += " FROM (SELECT " + v + " AS v, " + t + " AS t FROM ";
+	query += source;
+	query += " WHERE device = $1::text AND " + t + " >= " + from;
+	query += " AND " + t + " < " + to + ") s";
+	query += " HAVING count(*) > 0";
+	query += " ON CONFLICT (device, bucket) DO UPDATE SET";
+	query += " min = excluded.min, max = excluded.max,";
+	query += " sum = excluded.sum, count = excluded.count,";
+	query += " last = excluded.last, lasttime = excluded.lasttime";
+	prepare(stmt, query);
+      }
+
+    _withConnection([&](pqxx::connection& c)
+    {
+      pqxx::work w(c);
+      TraceSpan span("UPSERT", "rows", buckets.size());
+
+      for (auto it = buckets.begin(); it != buckets.end(); it++)
+	w.exec_prepared(stmt, it->device, it->start / 1000,
+			(it->start + width) / 1000);
+      w.commit();
+    });
+
+    return buckets.size();
+  }
+
+  int Database::bootstrap()
+  {
+    int applied = 0;
+
+    _withConnection([&](pqxx::connection& c)
+    {
+      pqxx::work w(c);
+      applied = 0;
+
+      // Keep two filers starting together from racing each other
+      w.exec("SELECT pg_advisory_xact_lock(hashtext('kittyfiler.schema'))");
+      w.exec("CREATE SCHEMA IF NOT EXISTS kittyfiler");
+      w.exec("CREATE TABLE IF NOT EXISTS kittyfiler.schema_version "
+	     "(version integer PRIMARY KEY, description text, "
+	     "applied timestamptz DEFAULT now())");
+
+      pqxx::result r =
+	w.exec("SELECT coalesce(max(version), 0) "
+	       "FROM kittyfiler.schema_version");
+      int current = r[0][0].as<int>();
+
+      if (current > Schema::latest())
+	{
+	  std::string e = "In Database::bootstrap: Schema version ";
+	  e += std::to_string(current);
+	  e += " is newer than this kittyfiler";
+	  throw std::runtime_error(e);
+	}
+
+      const std::vector<Migration>& m = Schema::migrations();
+      for (auto it = m.begin(); it != m.end(); it++)
+	{
+	  if (it->version <= current) continue;
+	  w.exec(it->sql);
+	  w.exec_params("INSERT INTO kittyfiler.schema_version "
+			"(version, description) VALUES ($1, $2)",
+			it->version, it->description);
+	  applied++;
+	}
+
+      // Fill the cache so append never has to ask the catalog
+      r = w.exec("SELECT table_schema, table_name "
+		 "FROM information_schema.tables WHERE table_schema "
+		 "NOT IN ('pg_catalog', 'information_schema')");
+      _tables.clear();
+      for (auto row = r.begin(); row != r.end(); row++)
+	{
+	  std::string schema = (*row)[0].as<std::string>();
+	  std::string name = (*row)[1].as<std::string>();
+	  _tables.insert(schema + "." + name);
+	  if (schema == "public") _tables.insert(name);
+	}
+
+      w.commit();
+    });
+
+    return applied;
+  }
+
   bool Database::tableExists(const std::string& table)
   {
-    pqxx::connection c(_conString());
-    pqxx::work w(c);
-    std::string query;
-    query += "SELECT table_name FROM information_schema.tables ";
-    query += "WHERE table_name='";
-    query += table.substr(table.find_first_of('.')+1);
-    query += "'";
-    pqxx::result r = w.exec(query);
-    w.commit();
-    if (!r.empty()) return 1;
+    if (_tables.count(table)) return 1;
+
+    // to_regclass resolves the schema part of the name too
+    pqxx::result r;
+    _withConnection([&](pqxx::connection& c)
+    {
+      pqxx::work w(c);
+      TraceSpan span("SELECT to_regclass");
+      r = w.exec_params("SELECT to_regclass($1) IS NOT NULL", table);
+      w.commit();
+    });
+
+    if (r[0][0].as<bool>())
+      {
+	_tables.insert(table);
+	return 1;
+      }
     return 0;
   }
 
   int Database::createTable(std::string table, svector headers,
-			    svector types)
+			    svector types,
+			    const std::string& partitionBy)
   {
     if (tableExists(table)) return -1;
-    pqxx::connection c(_conString());
-    pqxx::work w(c);
 
     // Build query
     std::string query = "CREATE TABLE ";
@@ -229,15 +646,80 @@ namespace Filer
       }
     query += ")";
 
+    if (!partitionBy.empty())
+      {
+	query += " PARTITION BY RANGE (";
+	query += partitionBy;
+	query += ")";
+      }
+
     // Execute table creation
-    w.exec(query);
-    w.commit();
+    _withConnection([&](pqxx::connection& c)
+    {
+      pqxx::work w(c);
+      w.exec(query);
+
+      if (!partitionBy.empty())
+	{
+	  w.exec("CREATE INDEX ON " + table + " USING brin ("
+		 + partitionBy + ")");
+	  w.exec_params("SELECT kittyfiler.ensure_partitions"
+			"($1::regclass, $2, now(), interval '3 months')",
+			table, partitionBy);
+	}
+
+      w.commit();
+    });
+    _tables.insert(table);
 
     // Return 0 on success
     return 0;
   }
 
-  std::string Database::_conString()
+  int Database::ensurePartitions(const std::string& table,
+				 const std::string& column,
+				 const std::string& since,
+				 const std::string& ahead)
+  {
+    int made = 0;
+
+    _withConnection([&](pqxx::connection& c)
+    {
+      pqxx::work w(c);
+      TraceSpan span("SELECT ensure_partitions");
+      pqxx::result r =
+	w.exec_params("SELECT kittyfiler.ensure_partitions"
+		      "($1::regclass, $2, $3::timestamptz, $4::interval)",
+		      table, column, since, ahead);
+      made = r[0][0].as<int>();
+      w.commit();
+    });
+
+    return made;
+  }
+
+  int Database::dropPartitions(const std::string& table,
+			       const std::string& keep)
+  {
+    int dropped = 0;
+
+    _withConnection([&](pqxx::connection& c)
+    {
+      pqxx::work w(c);
+      TraceSpan span("SELECT drop_partitions");
+      pqxx::result r =
+	w.exec_params("SELECT kittyfiler.drop_partitions"
+		      "($1::regclass, $2::interval)", table, keep);
+      dropped = r[0][0].as<int>();
+      w.commit();
+    });
+
+    // Dropped partitions must not be taken for live tables
+    if (dropped > 0) _tables.clear();
+    return dropped;
+  }
+
+  std::string Database::conString()
   {
     std::string cs = "host=";
     cs += _auth->host;
@@ -39,10 +39,20 @@
 
 #include <iostream>
 #include <vector>
+#include <map>
+#include <set>
+#include <functional>
+#include "batch.hpp"
+#include "rollup.hpp"
 
 #ifndef database_hpp
 #define database_hpp
 
+namespace pqxx
+{
+  class connection;
+}
+
 namespace Filer
 {
   struct auth
@@ -59,20 +69,93 @@ namespace Filer
   {
   public:
     typedef std::vector<std::string> svector;
+
+    /// How append sends rows to the server
+    enum ingest {INSERT, COPY};
+
+    /// Which columns samples are stored in. COMPACT keeps the raw
+    /// sensor reading as a smallint and times as epoch microseconds
+    enum layout {WIDE, COMPACT};
+
+    /// Check if e is the server refusing the samples themselves, a
+    /// data exception (SQLSTATE class 22) or integrity violation
+    /// (23), or a sample no column can hold. Anything else may clear
+    /// up, so the samples should be tried again later
+    static bool refused(const std::exception& e);
+
+    /// Check if e is a unique violation (SQLSTATE 23505), which COPY
+    /// raises for samples the table already holds
+    static bool duplicate(const std::exception& e);
+
+    /// Split CSV text into rows of fields, returns number of rows
+    static int parseCSV(std::istream& data, std::vector<svector>& dv);
+
     Database();
     explicit Database(auth* a);
+    Database(const Database& o) = delete;
+    ~Database();
     void init(auth* a);
     void clear();
+    /// Register a statement to prepare on the connection now and
+    /// again after every reconnect
+    void prepare(const std::string& name, const std::string& query);
+    /// Check if the held connection is currently up
+    bool isConnected();
+    /// Choose between one INSERT per row and a single COPY per append
+    void setIngest(ingest mode);
+    ingest ingestMode();
+    /// Choose the columns append stores samples in
+    void setLayout(layout l);
+    layout rowLayout();
     int append(const std::string& table, std::istream& data);
     int append(const std::string& table, std::istream& data,
 	       const svector& headers);
+    /// Send every sample of batch, by COPY or by an insert prepared
+    /// once per connection with typed parameters
+    int append(const std::string& table, const AmmoniaBatch& batch);
+    /// Sum up each bucket width ns wide again from the samples in
+    /// source, replacing its row in the rollup table. Returns buckets
+    /// sent
+    int upsert(const std::string& table, const std::string& source,
+	       long long width, const std::vector<RollupBucket>& buckets);
+    /// Bring the schema up to date, then remember every existing
+    /// table. Returns the number of migrations applied
+    int bootstrap();
+    /// Check if table exists, asking the server only on a cache miss
     bool tableExists(const std::string& table);
+    /// Create table with the given columns. With partitionBy, it is
+    /// range partitioned by month on that time column, which gets a
+    /// BRIN index, and the coming months' partitions are made
     int createTable(std::string table, svector headers,
-		    svector types);
+		    svector types,
+		    const std::string& partitionBy = std::string());
+    /// Make sure table has a partition for every month from the one
+    /// holding since to the one holding now plus ahead, both given
+    /// as Postgresql times. Returns the number created
+    int ensurePartitions(const std::string& table,
+			 const std::string& column,
+			 const std::string& since = "now",
+			 const std::string& ahead = "3 months");
+    /// Drop the partitions of table whose months ended more than
+    /// keep ago, a Postgresql interval. Returns the number dropped
+    int dropPartitions(const std::string& table, const std::string& keep);
+    /// libpq connection string for the auth given
+    std::string conString();
 
   private:
+    static const svector _ammoniaColumns;
+    static const svector _compactColumns;
     auth* _auth = NULL;
-    std::string _conString();
+    ingest _ingest = INSERT;
+    layout _layout = WIDE;
+    pqxx::connection* _con = NULL;
+    std::map<std::string, std::string> _prepared;
+    std::set<std::string> _tables;
+    pqxx::connection& _connection();
+    void _disconnect();
+    void _withConnection(const std::function<void(pqxx::connection&)>& f);
+    int _copy(const std::string& table, const std::vector<svector>& dv,
+	      const svector& headers);
   };
 }
 
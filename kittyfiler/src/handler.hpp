@@ -49,6 +49,8 @@ namespace Handler
 {
   bool _breakS = 0;
   bool _terminateP = 0;
+  bool _reportS = 0;
+  bool _reopenS = 0;
   std::ostream* _outptr;
   void _print(int sig)
   {
@@ -70,14 +72,42 @@ namespace Handler
     _print(sig);
   }
 
+  void signalReport(int sig)
+  {
+    _reportS = 1;
+  }
+
+  void signalReopen(int sig)
+  {
+    _reopenS = 1;
+  }
+
   bool breakS() {return _breakS;};
 
+  /// Check if a status report was asked for, clearing the request
+  bool reportS()
+  {
+    bool r = _reportS;
+    _reportS = 0;
+    return r;
+  }
+
+  /// Check if output files should be reopened, clearing the request
+  bool reopenS()
+  {
+    bool r = _reopenS;
+    _reopenS = 0;
+    return r;
+  }
+
   bool terminateP() {return _terminateP;};
 
   void reset()
   {
     _breakS = 0;
     _terminateP = 0;
+    _reportS = 0;
+    _reopenS = 0;
   }
 }
 
@@ -0,0 +1,298 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// journal.cpp
+
+#include "journal.hpp"
+#include "batch.hpp"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Filer
+{
+  // Every record is a type byte, a 16 bit device index, a 32 bit
+  // payload length and a 64 bit monotonic time, little endian, then
+  // the payload. Types are S for a session, whose payload is the wall
+  // clock time matching its monotonic time, D naming a device and R
+  // for bytes read
+  static const char journalMagic[8] = {'K','I','T','T','Y','J','R','1'};
+  static const size_t recordHeader = 15;
+
+  static void putLE(std::string& out, uint64_t v, int bytes)
+  {
+    for (int i = 0; i < bytes; i++)
+      out += static_cast<char>((v >> (8 * i)) & 0xff);
+  }
+
+  static uint64_t getLE(const char* p, int bytes)
+  {
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+      v = (v << 8) | static_cast<unsigned char>(p[i]);
+    return v;
+  }
+
+  static long long clockNs(clockid_t clock)
+  {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  }
+
+  JournalWriter::JournalWriter()
+  {
+  }
+
+  JournalWriter::~JournalWriter()
+  {
+    if (_fd >= 0) close(_fd);
+  }
+
+  void JournalWriter::open(const std::string& path)
+  {
+    _path = path;
+    _fd = ::open(_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+		 0644);
+
+    if (_fd < 0)
+      {
+	std::string err = "In Filer::JournalWriter::open: ";
+	err += "Could not open " + _path + ": ";
+	err += strerror(errno);
+	throw std::runtime_error(err);
+      }
+
+    struct stat st;
+    if (fstat(_fd, &st) < 0)
+      {
+	std::string err = "In Filer::JournalWriter::open: ";
+	err += "Could not stat " + _path + ": ";
+	err += strerror(errno);
+	throw std::runtime_error(err);
+      }
+
+    // Cut off a record torn by a crash part way through a write, so
+    // the new session follows the last whole record
+    size_t valid = _validate(st.st_size);
+    if (valid < static_cast<size_t>(st.st_size))
+      {
+	std::cerr << "JournalWriter: dropping " << st.st_size - valid
+		  << " torn bytes from " << _path << std::endl;
+	if (ftruncate(_fd, valid) < 0)
+	  {
+	    std::string err = "In Filer::JournalWriter::open: ";
+	    err += "Could not truncate " + _path + ": ";
+	    err += strerror(errno);
+	    throw std::runtime_error(err);
+	  }
+      }
+
+    // A new journal starts with the magic, an old one already has it
+    if (valid == 0
+	&& ::write(_fd, journalMagic, sizeof(journalMagic))
+	!= sizeof(journalMagic))
+      {
+	std::string err = "In Filer::JournalWriter::open: ";
+	err += "Could not write " + _path + ": ";
+	err += strerror(errno);
+	throw std::runtime_error(err);
+      }
+
+    std::string real;
+    long long mono = clockNs(CLOCK_MONOTONIC);
+    putLE(real, clockNs(CLOCK_REALTIME), 8);
+    _write('S', 0, mono, real);
+  }
+
+  // Return the length of the magic and the run of whole records
+  // after it, or 0 if not even the magic was written. Records carry
+  // no checksum, so only their framing can be checked
+  size_t JournalWriter::_validate(size_t size)
+  {
+    if (size < sizeof(journalMagic)) return 0;
+
+    int fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      {
+	std::string err = "In Filer::JournalWriter::_validate: ";
+	err += "Could not open " + _path + ": ";
+	err += strerror(errno);
+	throw std::runtime_error(err);
+      }
+
+    char m[sizeof(journalMagic)];
+    if (pread(fd, m, sizeof(m), 0) != sizeof(m)
+	|| memcmp(m, journalMagic, sizeof(m)) != 0)
+      {
+	close(fd);
+	std::string err = "In Filer::JournalWriter::_validate: ";
+	err += _path + " is not a kittyfiler journal";
+	throw std::runtime_error(err);
+      }
+
+    size_t off = sizeof(journalMagic);
+
+    while (off + recordHeader <= size)
+      {
+	char head[recordHeader];
+	if (pread(fd, head, recordHeader, off) != recordHeader) break;
+
+	char type = head[0];
+	size_t len = getLE(head + 3, 4);
+	if (type != 'S' && type != 'D' && type != 'R') break;
+	if (type == 'S' && len != 8) break;
+	if (len > size - off - recordHeader) break;
+
+	off += recordHeader + len;
+      }
+
+    close(fd);
+    return off;
+  }
+
+  void JournalWriter::addDevice(int device, std::string_view name)
+  {
+    _write('D', device, clockNs(CLOCK_MONOTONIC), name);
+  }
+
+  void JournalWriter::record(int device, std::string_view data)
+  {
+    _write('R', device, clockNs(CLOCK_MONOTONIC), data);
+  }
+
+  void JournalWriter::record(int device, std::string_view data,
+			     long long mono)
+  {
+    _write('R', device, mono, data);
+  }
+
+  void JournalWriter::_write(char type, int device, long long mono,
+			     std::string_view payload)
+  {
+    _record.clear();
+    _record += type;
+    putLE(_record, device, 2);
+    putLE(_record, payload.size(), 4);
+    putLE(_record, mono, 8);
+    _record.append(payload);
+
+    // One write per record, so the reader never sees half of one
+    // unless the program died mid-write
+    if (::write(_fd, _record.data(), _record.size())
+	!= static_cast<ssize_t>(_record.size()))
+      {
+	std::string err = "In Filer::JournalWriter::_write: ";
+	err += "Could not write " + _path + ": ";
+	err += strerror(errno);
+	throw std::runtime_error(err);
+      }
+  }
+
+  JournalReader::JournalReader(const std::string& path)
+    :_path(path), _in(path, std::ios::binary)
+  {
+    char m[sizeof(journalMagic)];
+
+    if (!_in.read(m, sizeof(m))
+	|| memcmp(m, journalMagic, sizeof(m)) != 0)
+      {
+	std::string err = "In Filer::JournalReader::JournalReader: ";
+	err += _path + " is not a kittyfiler journal";
+	throw std::runtime_error(err);
+      }
+  }
+
+  bool JournalReader::next(JournalRecord& r)
+  {
+    char head[recordHeader];
+
+    while (_in.read(head, recordHeader))
+      {
+	char type = head[0];
+	size_t device = getLE(head + 1, 2);
+	size_t len = getLE(head + 3, 4);
+	long long mono = getLE(head + 7, 8);
+
+	r.data.resize(len);
+	if (len > 0 && !_in.read(&r.data[0], len)) return false;
+
+	switch (type)
+	  {
+	  case 'S':
+	    if (len != 8) break;
+	    _monoBase = mono;
+	    _realBase = getLE(r.data.data(), 8);
+	    _session++;
+	    _devices.clear();
+	    break;
+
+	  case 'D':
+	    if (_devices.size() <= device) _devices.resize(device + 1);
+	    _devices[device] = AmmoniaBatch::intern(r.data);
+	    break;
+
+	  case 'R':
+	    if (device >= _devices.size())
+	      {
+		std::string err = "In Filer::JournalReader::next: ";
+		err += "Read from unnamed device in " + _path;
+		throw std::runtime_error(err);
+	      }
+	    r.device = _devices[device];
+	    r.mono = mono;
+	    r.real = _realBase + (mono - _monoBase);
+	    r.session = _session;
+	    return 1;
+
+	  default:
+	    {
+	      std::string err = "In Filer::JournalReader::next: ";
+	      err += "Unknown record in " + _path;
+	      throw std::runtime_error(err);
+	    }
+	  }
+      }
+
+    return 0;
+  }
+}
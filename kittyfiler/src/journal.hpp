@@ -0,0 +1,120 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// journal.hpp
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef journal_hpp
+#define journal_hpp
+
+namespace Filer
+{
+  /// One read from a device as recorded in a journal
+  struct JournalRecord
+  {
+    /// Interned name of the device read from
+    std::string_view device;
+    /// CLOCK_MONOTONIC time of the read, ns
+    long long mono = 0;
+    /// Wall clock time of the read, ns since the epoch
+    long long real = 0;
+    /// Counts up each time the recording program was restarted, as
+    /// monotonic times from different runs can't be compared
+    unsigned session = 0;
+    /// Bytes exactly as read from the port
+    std::string data;
+  };
+
+  /// Append-only file of the raw bytes read from each port and when
+  /// they arrived. Each run starts a session pairing the monotonic
+  /// clock with the wall clock, so only monotonic times are stored
+  /// per read
+  class JournalWriter
+  {
+  public:
+    JournalWriter();
+    JournalWriter(const JournalWriter& o) = delete;
+    ~JournalWriter();
+
+    /// Open path for appending and start a new session
+    void open(const std::string& path);
+    bool isOpen() {return _fd >= 0;};
+
+    /// Name the device that reads with index device come from
+    void addDevice(int device, std::string_view name);
+
+    /// Record bytes read from a device just now
+    void record(int device, std::string_view data);
+
+    /// Record bytes read from a device at CLOCK_MONOTONIC time mono
+    void record(int device, std::string_view data, long long mono);
+
+  private:
+    std::string _path;
+    int _fd = -1;
+    std::string _record;
+    size_t _validate(size_t size);
+    void _write(char type, int device, long long mono,
+		std::string_view payload);
+  };
+
+  /// Reads back a journal written by JournalWriter
+  class JournalReader
+  {
+  public:
+    explicit JournalReader(const std::string& path);
+
+    /// Read the next device read into r. Returns false at the end
+    /// of the journal, or where a crash cut a record short
+    bool next(JournalRecord& r);
+
+  private:
+    std::string _path;
+    std::ifstream _in;
+    std::vector<std::string_view> _devices;
+    long long _monoBase = 0;
+    long long _realBase = 0;
+    unsigned _session = 0;
+  };
+}
+
+#endif
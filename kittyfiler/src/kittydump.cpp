@@ -0,0 +1,115 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// kittydump.cpp
+
+// Convert block files written by kittyfiler -B back to CSV
+
+#include "blockfile.hpp"
+#include "batch.hpp"
+#include "cli.hpp"
+#include <iostream>
+#include <string>
+
+static void printUsage(std::ostream& out)
+{
+  Cli::Usage u;
+
+  u.addApp("kittydump");
+  u.addDescription("Print the samples in kittyfiler block files as CSV, "
+		   "in the same columns as kittyfiler -f.");
+  u.addUseCase({'t','i'}, {}, {"<file> [<file> ...]"});
+  u.addUseCase({'h'}, {}, {});
+  u.addOption('t', "add the time each frame was read as a column before "
+	      "the device");
+  u.addOption('i', "print one line per block with its row count and time "
+	      "ranges instead of the samples");
+  u.addOption('h', "Print this help message, then exit");
+  u.print(out);
+}
+
+int main(int argc, char** argv)
+{
+  try
+    {
+      Cli::Args al(argc, argv);
+
+      if (al.option('h') || al.size() < 1)
+	{
+	  printUsage(std::cout);
+	  return 0;
+	}
+
+      Filer::AmmoniaBatch batch;
+      Filer::BlockHeader h;
+      std::string rows;
+
+      for (size_t i = 0; i < al.size(); i++)
+	{
+	  Filer::BlockReader in(al.arg(i));
+
+	  if (al.option('i'))
+	    {
+	      while (in.next(h))
+		std::cout << al.arg(i) << " rows=" << h.rows
+			  << " timemillis=" << h.minTime << "-" << h.maxTime
+			  << " read="
+			  << Filer::AmmoniaBatch::isoTimestamp(h.minRead)
+			  << "/"
+			  << Filer::AmmoniaBatch::isoTimestamp(h.maxRead)
+			  << std::endl;
+	      continue;
+	    }
+
+	  batch.clear();
+	  while (in.next(h, &batch))
+	    {
+	      rows.clear();
+	      batch.appendCSV(rows, al.option('t'));
+	      std::cout.write(rows.data(), rows.size());
+	      batch.clear();
+	    }
+	}
+    }
+  catch (std::exception& e)
+    {
+      std::cerr << e.what() << std::endl;
+      return -1;
+    }
+
+  return 0;
+}
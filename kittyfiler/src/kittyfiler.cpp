@@ -42,48 +42,41 @@
 #include "app.hpp"
 #include "connection.hpp"
 #include "database.hpp"
+#include "batch.hpp"
+#include "parser.hpp"
+#include "poller.hpp"
+#include "pipeline.hpp"
+#include "journal.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
 #include "handler.hpp"
+#include <chrono>
 #include <iostream>
 #include <vector>
+#include <map>
 #include <string>
+#include <string_view>
 #include <sstream>
-#include <poll.h>
 #include <signal.h>
 #include <ctime>
 
-/// Return the current timestamp with optional format option
-std::string makeTimestamp(const std::string& format = "%m/%d/%Y %T %Z")
-{
-  struct tm * ttm;
-
-  time_t tt;
-  size_t tbsize = 30;
-  char readTime[tbsize];
-
-  time (&tt);
-  ttm = localtime(&tt);
-  strftime(readTime, tbsize, format.c_str(), ttm);
-
-  delete ttm;
-
-  return std::string(readTime);
-}
-
 int main(int argc, char** argv)
 { 
-  Filer::Connection* c = NULL;
+  std::vector<Filer::Connection*> c;
+  std::string tracePath;
 
   // Use signal to setup handling of signals
   Handler::_outptr = &std::cerr;
-  signal(SIGHUP, Handler::signalTerminate);
+  signal(SIGHUP, Handler::signalReopen);
   signal(SIGINT, Handler::signalBreak);
   signal(SIGTERM, Handler::signalTerminate);
   signal(SIGABRT, Handler::signalTerminate);
+  signal(SIGUSR1, Handler::signalReport);
 
   try
     {
       // Parse CLI arguments
-      char oaList[] = {'f','H','d','u','P'};
+      char oaList[] = {'f','H','d','u','P','Q','D','S','Z','F','B','R','j','J','M','T','G','A','k'};
       Cli::Args al(argc, argv, oaList, sizeof(oaList)/sizeof(oaList[0]));
       Filer::App app(al);
 
@@ -101,73 +94,410 @@ int main(int argc, char** argv)
 	  return 0;
 	}
 
-      // If there no arguments given, print usage and exit
-      if (al.size() != 1)
+      // If there no arguments given, print usage and exit. A replay
+      // needs no devices
+      if (al.size() < 1 && !al.option('J'))
 	{
 	  Filer::App::printUsage(std::cout);
 	  return 0;
 	}
 
-      // Try to log data
-      std::string special = al.arg(0);
-      c = new Filer::Connection(special.c_str());
+      if (al.size() > 0 && al.option('J'))
+	throw std::runtime_error("Devices can't be read during a replay");
 
-      // Loop until user provides input or interrupt
-      for (;;)
+      // Record spans from here on if a trace is wanted
+      if (al.option('T'))
 	{
-	  // Break if signal handler requests it
-	  if (!Handler::breakS())
-	    break;
+	  tracePath = al.optarg('T');
+	  Filer::Trace::enable();
+	  Filer::Trace::nameThread("reader");
+	}
 
-	  // Poll for user input
-	  struct pollfd pfd;
+      // Open every device given. Connection keeps a pointer to the
+      // name, so the names must stay put while the ports are open
+      std::vector<std::string> specials;
+      for (size_t i = 0; i < al.size(); i++)
+	specials.push_back(al.arg(i));
 
-	  pfd.fd = c->fd();
-	  pfd.events = POLLIN;
+      Filer::Poller poller;
+      for (size_t i = 0; i < specials.size(); i++)
+	{
+	  c.push_back(new Filer::Connection(specials[i].c_str()));
+	  poller.add(c.back()->fd(), i);
+	}
 
-	  if (poll(&pfd, 1, 60000) >= 0)
-	    break;
+      // Record every read from every port if asked
+      Filer::JournalWriter journal;
+      if (al.option('j'))
+	{
+	  journal.open(al.optarg('j'));
+	  for (size_t i = 0; i < c.size(); i++)
+	    journal.addDevice(i, c[i]->device());
+	}
 
-	  // Read next line from source into stringstream
-	  std::stringstream ss;
+      // Set up the schema once so frames never wait on the catalog
+      if (al.option('b'))
+	{
+	  int applied = app.databaseSetup();
+	  if (applied > 0)
+	    std::cerr << "Applied " << applied
+		      << " schema migrations" << std::endl;
+	}
 
-	  c->readUntil(ss, '\n');
+      // Each output gets its own thread and queue, so a slow one
+      // never stops the ports from being drained
+      std::map<std::string, std::string> policies;
+      if (al.option('Q')) policies = Cli::splitPairs(al.optarg('Q'));
+      size_t depth = 64;
+      if (al.option('D')) depth = std::stoul(al.optarg('D'));
+
+      auto policy = [&](const std::string& sink)
+      {
+	auto it = policies.find(sink);
+	if (it == policies.end()) return Filer::Sink::BLOCK;
+	return Filer::Sink::parsePolicy(it->second);
+      };
+
+      Filer::Pipeline pipeline;
+      bool parse = al.option('f') || al.option('b') || al.option('B');
+
+      // If -p option is set send output as it comes in to std out
+      if (al.option('p'))
+	pipeline.add(new Filer::Sink("print", [&](const Filer::Frame& f)
+	{
+	  app.printOutput(f.raw);
+	}, policy("print"), depth));
 
-	  // If -p option is set send output as it comes in to
-	  // std out, then return to front of stringstream
-	  if (al.option('p'))
+      // If -f option is set, send to file specified by the user by
+      // option or other means
+      if (al.option('f'))
+	{
+	  app.fileSetup();
+	  Filer::Sink& file = pipeline.add(new Filer::Sink
+	    ("file", [&](const Filer::Frame& f)
 	    {
-	      app.printOutput(ss);
-	      ss.seekg(0);
-	    }
+	      app.fileOutput(f.batch);
+	    }, policy("file"), depth));
+	  file.onIdle([&]()
+	  {
+	    app.fileTick();
+	  });
+	}
 
-	  // If -f option is set, send to file specified by
-	  // the user by option or other means
-	  if (al.option('f'))
+      // If -B option is set, write compressed blocks to the file
+      // given
+      if (al.option('B'))
+	{
+	  app.blockSetup();
+	  Filer::Sink& blocks = pipeline.add(new Filer::Sink
+	    ("binary", [&](const Filer::Frame& f)
 	    {
-	      app.fileOutput(ss);
-	      ss.seekg(0);
+	      app.blockOutput(f.batch);
+	    }, policy("binary"), depth));
+	  blocks.onIdle([&]()
+	  {
+	    app.blockTick();
+	  });
+	}
+
+      // If -b option is set, log to database set up in app
+      // configuration. Once its queue is half full the database is
+      // falling behind, so frames go to the spool if there is one
+      Filer::Sink* db = NULL;
+      if (al.option('b'))
+	{
+	  db = &pipeline.add(new Filer::Sink("db", [&](const Filer::Frame& f)
+	  {
+	    app.databaseOutput(f.batch, db->depth() * 2 > db->capacity());
+	  }, policy("db"), depth));
+	  db->onIdle([&]()
+	  {
+	    app.databaseTick();
+	  });
+	}
+
+      pipeline.start();
+      std::vector<size_t> ready;
+      Filer::Metrics& metrics = Filer::metrics();
+      unsigned long long seq = 0;
+
+      // Rewrite the metrics file every 15 s, for the node exporter's
+      // textfile collector or anything else that reads it
+      auto metricsDue = std::chrono::steady_clock::now();
+      auto writeMetrics = [&](bool now)
+      {
+	if (!al.option('M')) return;
+	if (!now && std::chrono::steady_clock::now() < metricsDue) return;
+	metricsDue = std::chrono::steady_clock::now()
+	  + std::chrono::seconds(15);
+
+	std::ostringstream out;
+	metrics.write(out);
+	pipeline.writeMetrics(out);
+	app.writeMetrics(out);
+
+	try
+	  {
+	    Filer::writeTextfile(al.optarg('M'), out.str());
+	  }
+	catch (std::runtime_error& e)
+	  {
+	    std::cerr << e.what() << std::endl;
+	  }
+      };
+
+      // Bytes of overlong frames already reported for each device
+      std::map<std::string_view, unsigned long long> discarded;
+
+      // Hand every complete frame now in a buffer to the outputs,
+      // parsed once into typed columns if they need it
+      auto deliver = [&](Filer::FrameBuffer& buffer,
+			 std::string_view device)
+      {
+	std::string_view frame;
+	Filer::Stamp at;
+	size_t n = 0;
+
+	while (buffer.next(frame, '\n', at))
+	  {
+	    Filer::Frame* f = new Filer::Frame;
+	    f->raw.assign(frame);
+	    f->received = std::chrono::steady_clock::time_point
+	      (std::chrono::nanoseconds(at.monotonic));
+	    f->readtime = at.realtime;
+	    f->seq = seq++;
+
+	    if (parse)
+	      {
+		Filer::FrameInfo info;
+		info.device = device;
+		info.readtime = at.realtime;
+		info.monotonic = at.monotonic;
+		int rows;
+		{
+		  Filer::TraceSpan span("parse", "frame", f->seq);
+		  Filer::StageTimer timer(metrics.parse);
+		  rows = Filer::FrameParser::parse(frame, f->batch, info);
+		}
+		if (rows < 0) metrics.parseErrors.add();
+		else metrics.rows.add(rows);
+	      }
+
+	    pipeline.offer(f);
+	    n++;
+	  }
+
+	metrics.frames.add(n);
+
+	if (buffer.discarded() > discarded[device])
+	  {
+	    std::cerr << "Device " << device << ": dropped "
+		      << buffer.discarded() - discarded[device]
+		      << " bytes of frames over the size limit" << std::endl;
+	    discarded[device] = buffer.discarded();
+	  }
+
+	return n;
+      };
+
+      // Feed a journal through the same framing and outputs as the
+      // ports, at the pace it was recorded or as fast as possible
+      if (al.option('J'))
+	{
+	  // With no ports open, the loop below ends straight away
+	  Filer::JournalReader in(al.optarg('J'));
+	  Filer::JournalRecord r;
+	  std::map<std::string_view, Filer::FrameBuffer> buffers;
+	  bool pace = !al.option('X');
+	  unsigned session = 0;
+	  unsigned fed = 0;
+	  long long base = 0;
+	  unsigned long long frames = 0;
+	  unsigned long long bytes = 0;
+	  auto start = std::chrono::steady_clock::now();
+	  auto baseAt = start;
+
+	  while (!Handler::breakS() && !pipeline.failed() && in.next(r))
+	    {
+	      if (Handler::reportS())
+		{
+		  pipeline.report(std::cerr);
+		  app.report(std::cerr);
+		  metrics.report(std::cerr);
+		}
+
+	      writeMetrics(0);
+
+	      if (pace)
+		{
+		  // Times from different runs can't be compared, so
+		  // pace each run from its own first read
+		  if (r.session != session)
+		    {
+		      session = r.session;
+		      base = r.mono;
+		      baseAt = std::chrono::steady_clock::now();
+		    }
+
+		  // Sleep in short steps so an interrupt still stops us
+		  auto due = baseAt + std::chrono::nanoseconds(r.mono - base);
+		  while (!Handler::breakS()
+			 && std::chrono::steady_clock::now() < due)
+		    std::this_thread::sleep_until
+		      (std::min(due, std::chrono::steady_clock::now()
+				+ std::chrono::milliseconds(100)));
+		}
+
+	      // Rows keep the recorded read times, but latencies are
+	      // measured on this run's clock
+	      Filer::Stamp at = Filer::Stamp::now();
+	      at.realtime = r.real;
+
+	      // A frame a run was cut off in the middle of never ends,
+	      // so drop it rather than prefix the next run's first frame
+	      if (r.session != fed)
+		{
+		  for (auto& [device, buffer] : buffers)
+		    {
+		      if (buffer.pending())
+			std::cerr << "Device " << device << ": dropped "
+				  << buffer.pending() << " bytes of a frame"
+				  << " cut off at the end of a run"
+				  << std::endl;
+		      discarded[device] = 0;
+		    }
+
+		  buffers.clear();
+		  fed = r.session;
+		}
+
+	      Filer::FrameBuffer& buffer = buffers[r.device];
+	      buffer.write(r.data.data(), r.data.size(), at);
+	      metrics.bytes.add(r.data.size());
+	      frames += deliver(buffer, r.device);
+	      bytes += r.data.size();
 	    }
 
-	  // If -b option is set, log to database set up in
-	  // app configuration
-	  if (al.option('b'))
+	  // Count the time the outputs take to finish too
+	  pipeline.stop();
+	  double s = std::chrono::duration<double>
+	    (std::chrono::steady_clock::now() - start).count();
+	  std::cerr << "Replayed " << frames << " frames, " << bytes
+		    << " bytes in " << s << " s, " << frames / s
+		    << " frames/s" << std::endl;
+	}
+
+      // Loop until user provides input or interrupt
+      for (;;)
+	{
+	  // Break if signal handler requests it
+	  if (Handler::breakS())
+	    break;
+
+	  // Stop once every device has gone away, or an output failed
+	  if (poller.size() == 0 || pipeline.failed())
+	    break;
+
+	  if (Handler::reportS())
 	    {
-	      std::string stringTime = makeTimestamp();
+	      pipeline.report(std::cerr);
+	      app.report(std::cerr);
+	      metrics.report(std::cerr);
+	    }
+
+	  writeMetrics(0);
 
-	      app.databaseOutput(ss, stringTime);
-	      ss.seekg(0);
+	  // Pick up files moved away by logrotate
+	  if (Handler::reopenS())
+	    app.reopen();
+
+	  // Go back and check the handler on timeout or interrupt
+	  if (poller.wait(ready, 1000) == 0)
+	    continue;
+
+	  // Stamp every ready port with when the poller woke, so time
+	  // spent serving the ports ahead of it in this batch doesn't
+	  // count against its frames. What is left is the wakeup
+	  // latency, plus at most one pass of this loop for bytes that
+	  // arrive after the wakeup but are picked up by the same read
+	  Filer::Stamp woke = Filer::Stamp::now();
+
+	  for (auto it = ready.begin(); it != ready.end(); it++)
+	    {
+	      Filer::Connection* dev = c[*it];
+
+	      // Pull whatever the device has sent into its frame
+	      // buffer. Drop the device if it has hung up or failed,
+	      // the others carry on
+	      ssize_t got = 0;
+	      try
+		{
+		  // Each device's reads show up under its own name
+		  Filer::TraceSpan span(dev->device());
+		  Filer::StageTimer timer(metrics.read);
+		  got = dev->fill(woke);
+		  span.arg("bytes", got);
+		}
+	      catch (std::runtime_error& e)
+		{
+		  std::cerr << "Device " << dev->device() << ": "
+			    << e.what() << std::endl;
+		}
+
+	      // Woken with nothing to read, wait for the next event
+	      if (got < 0) continue;
+
+	      if (got > 0) metrics.bytes.add(got);
+	      if (got > 0 && journal.isOpen())
+		journal.record(*it, dev->buffer().last(),
+			       dev->buffer().lastStamp().monotonic);
+
+	      if (got == 0)
+		{
+		  std::cerr << "Device " << dev->device()
+			    << " closed" << std::endl;
+		  metrics.deviceCloses.add();
+		  poller.remove(dev->fd());
+		  dev->closePort();
+		  continue;
+		}
+
+	      deliver(dev->buffer(), dev->device());
 	    }
 	}
+
+      // Let every output finish what it has queued
+      pipeline.stop();
+
+      // Commit whatever is still held for a group commit
+      if (al.option('b') && !pipeline.failed()) app.databaseFinish();
+
+      writeMetrics(1);
+      if (!tracePath.empty()) Filer::Trace::dump(tracePath);
+
+      if (pipeline.failed())
+	throw std::runtime_error(pipeline.error());
     }
   catch (std::exception& e)
     {
-      if (c) c->closePort();
+      // The trace is most useful when something went wrong
+      try
+	{
+	  if (!tracePath.empty()) Filer::Trace::dump(tracePath);
+	}
+      catch (std::exception& d)
+	{
+	  std::cout << d.what() << std::endl;
+	}
+
+      for (auto it = c.begin(); it != c.end(); it++)
+	delete *it;
       std::cout << e.what() << std::endl;
       return -1;
     }
 
-  delete c;
+  for (auto it = c.begin(); it != c.end(); it++)
+    delete *it;
 
   std::cout << "Exiting" << std::endl;
   return 0;
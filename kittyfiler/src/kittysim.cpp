@@ -0,0 +1,388 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// kittysim.cpp
+
+// Stand in for kittycomfort boards: open a pseudo terminal per
+// simulated device and send frames on it shaped exactly like the
+// sketch's DataStructure::jsonFullString
+
+#include "cli.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock Clock;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int)
+{
+  stopping = 1;
+}
+
+/// What every simulated board does, set from the command line
+struct Settings
+{
+  /// Sketch readoutDelay and transmitDelay, ms of device time
+  uint32_t readout = 10000;
+  uint32_t transmit = 60000;
+  /// Samples in each frame
+  size_t samples = 6;
+  /// Device ms that pass per wall clock ms
+  double speed = 1;
+  /// millis() when the simulation starts, to reach rollover sooner
+  uint32_t startMillis = 0;
+  /// millis() after which samples are warmed up
+  uint32_t warmUp = 120000;
+  /// Reset the board every this many frames, 0 for never
+  unsigned long resetEvery = 0;
+  /// Percent of frames sent corrupt or cut short
+  double corrupt = 0;
+  /// Stop after this many frames per device, 0 to run until stopped
+  unsigned long frames = 0;
+};
+
+/// One simulated board and the pseudo terminal it talks through
+struct Device
+{
+  int master = -1;
+  int slave = -1;
+  std::string name;
+  std::string link;
+  /// The board's millis(), wrapping like the 32 bit original
+  uint32_t millis = 0;
+  double counts = 400;
+  unsigned long sent = 0;
+  unsigned long long bytes = 0;
+  unsigned long long dropped = 0;
+  Clock::time_point due;
+};
+
+static void fail(const std::string& what)
+{
+  std::string err = "In kittysim: ";
+  err += what + ": ";
+  err += strerror(errno);
+  throw std::runtime_error(err);
+}
+
+// Open a pty pair. The slave end is held open and put in raw mode, so
+// it stays usable between runs of the reader
+static void openDevice(Device& d)
+{
+  d.master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (d.master < 0) fail("posix_openpt");
+
+  if (grantpt(d.master) < 0 || unlockpt(d.master) < 0)
+    fail("Could not unlock pty");
+
+  d.name = ptsname(d.master);
+  d.slave = open(d.name.c_str(), O_RDWR | O_NOCTTY);
+  if (d.slave < 0) fail("Could not open " + d.name);
+
+  struct termios t;
+  if (tcgetattr(d.slave, &t) < 0) fail("tcgetattr");
+  cfmakeraw(&t);
+  if (tcsetattr(d.slave, TCSANOW, &t) < 0) fail("tcsetattr");
+
+  // Like a real serial line, output with no one reading is lost
+  // rather than holding up every other device
+  fcntl(d.master, F_SETFL, fcntl(d.master, F_GETFL) | O_NONBLOCK);
+}
+
+// Arduino's String(double) prints two decimals
+static void appendValue(std::string& out, double v)
+{
+  char num[32];
+  snprintf(num, sizeof(num), "%.2f", v);
+  out += num;
+}
+
+// Build one frame as jsonBuildHeader, jsonDataString and
+// jsonBuildFooter do. Samples are read every readout ms up to the
+// send, all arithmetic on the 32 bit millis()
+static std::string makeFrame(Device& d, const Settings& s,
+			     std::mt19937& rng)
+{
+  std::normal_distribution<double> drift(0, 2);
+  std::string f = "{\"project\": \"kittycomfort\",\"sentmillis\": ";
+  f += std::to_string(d.millis);
+  f += ",\"data\": [";
+
+  for (size_t i = 0; i < s.samples; i++)
+    {
+      uint32_t t = d.millis - (s.samples - i) * s.readout;
+      d.counts = std::min(1023.0, std::max(0.0, d.counts + drift(rng)));
+
+      f += "{\"value\": ";
+      appendValue(f, std::round(d.counts));
+      f += ",\"timemillis\": ";
+      f += std::to_string(t);
+      f += ",\"iswarmedup\": ";
+      f += t > s.warmUp ? "true" : "false";
+      f += "}";
+      if (i < s.samples - 1) f += ",";
+    }
+
+  f += "],\"EOT\": true}\n";
+  return f;
+}
+
+// Damage a frame the way a noisy line does: flip a byte, or lose the
+// end of it so it runs into the next frame
+static void corruptFrame(std::string& f, std::mt19937& rng)
+{
+  std::uniform_int_distribution<size_t> at(0, f.size() - 2);
+
+  if (rng() % 2)
+    f[at(rng)] ^= 1 << (rng() % 7);
+  else
+    f.resize(at(rng));
+}
+
+static void send(Device& d, const std::string& data)
+{
+  ssize_t n = write(d.master, data.data(), data.size());
+
+  if (n < 0 && errno != EAGAIN && errno != EINTR) fail("write");
+  if (n < 0) n = 0;
+
+  d.bytes += n;
+  d.dropped += data.size() - n;
+}
+
+static void printUsage(std::ostream& out)
+{
+  Cli::Usage u;
+
+  u.addApp("kittysim");
+  u.addDescription("Simulate kittycomfort boards on pseudo terminals. The "
+		   "name of each terminal is printed on its own line, "
+		   "ready to give to kittyfiler.");
+  u.addUseCase({},
+	       {std::make_pair('n', "<devices>"),
+		std::make_pair('x', "<speed>"),
+		std::make_pair('r', "<ms>"),
+		std::make_pair('t', "<ms>"),
+		std::make_pair('s', "<samples>"),
+		std::make_pair('m', "<millis>"),
+		std::make_pair('w', "<ms>"),
+		std::make_pair('R', "<frames>"),
+		std::make_pair('c', "<percent>"),
+		std::make_pair('f', "<frames>"),
+		std::make_pair('l', "<prefix>"),
+		std::make_pair('S', "<seed>")},
+	       {});
+  u.addUseCase({'h'}, {}, {});
+  u.addOption('n', "number of boards to simulate, default 1");
+  u.addOption('x', "run the boards' clocks this many times faster than "
+	      "real time, default 1");
+  u.addOption('r', "ms between samples, default 10000");
+  u.addOption('t', "ms between frames, default 60000");
+  u.addOption('s', "samples per frame, default t / r");
+  u.addOption('m', "millis() at the start. 4294000000 reaches the 32 bit "
+	      "rollover in about 16 minutes of board time");
+  u.addOption('w', "millis() after which samples are warmed up, default "
+	      "120000");
+  u.addOption('R', "reset each board every <frames> frames, restarting "
+	      "millis() and printing the sketch's boot line");
+  u.addOption('c', "percent of frames to corrupt or cut short");
+  u.addOption('f', "stop after each board sends <frames> frames");
+  u.addOption('l', "link <prefix>0, <prefix>1 ... to the terminals");
+  u.addOption('S', "seed for the random values, for repeatable runs");
+  u.addOption('h', "Print this help message, then exit");
+  u.print(out);
+}
+
+int main(int argc, char** argv)
+{
+  std::vector<Device> devices;
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  signal(SIGHUP, stop);
+  signal(SIGPIPE, SIG_IGN);
+
+  try
+    {
+      char oaList[] = {'n','x','r','t','s','m','w','R','c','f','l','S'};
+      Cli::Args al(argc, argv, oaList, sizeof(oaList)/sizeof(oaList[0]));
+
+      if (al.option('h'))
+	{
+	  printUsage(std::cout);
+	  return 0;
+	}
+
+      Settings s;
+      size_t n = 1;
+      unsigned seed = std::random_device()();
+      if (al.option('n')) n = std::stoul(al.optarg('n'));
+      if (al.option('x')) s.speed = std::stod(al.optarg('x'));
+      if (al.option('r')) s.readout = std::stoul(al.optarg('r'));
+      if (al.option('t')) s.transmit = std::stoul(al.optarg('t'));
+      s.samples = s.readout > 0 ? s.transmit / s.readout : 1;
+      if (al.option('s')) s.samples = std::stoul(al.optarg('s'));
+      if (al.option('m')) s.startMillis = std::stoul(al.optarg('m'));
+      if (al.option('w')) s.warmUp = std::stoul(al.optarg('w'));
+      if (al.option('R')) s.resetEvery = std::stoul(al.optarg('R'));
+      if (al.option('c')) s.corrupt = std::stod(al.optarg('c'));
+      if (al.option('f')) s.frames = std::stoul(al.optarg('f'));
+      if (al.option('S')) seed = std::stoul(al.optarg('S'));
+
+      if (s.samples == 0 || s.speed <= 0)
+	throw std::runtime_error("In kittysim: Need at least one sample "
+				 "and a positive speed");
+
+      std::mt19937 rng(seed);
+      std::uniform_real_distribution<double> phase(0, 1);
+      std::uniform_real_distribution<double> percent(0, 100);
+      auto period = std::chrono::duration<double, std::milli>
+	(s.transmit / s.speed);
+      Clock::time_point start = Clock::now();
+
+      devices.resize(n);
+      for (size_t i = 0; i < n; i++)
+	{
+	  Device& d = devices[i];
+	  openDevice(d);
+
+	  if (al.option('l'))
+	    {
+	      d.link = al.optarg('l') + std::to_string(i);
+	      unlink(d.link.c_str());
+	      if (symlink(d.name.c_str(), d.link.c_str()) < 0)
+		fail("Could not link " + d.link);
+	    }
+
+	  // Spread the boards out so they don't all send at once
+	  d.millis = s.startMillis;
+	  d.due = start + std::chrono::duration_cast<Clock::duration>
+	    (period * phase(rng));
+	  std::cout << (d.link.empty() ? d.name : d.link) << std::endl;
+	}
+
+      unsigned long finished = 0;
+
+      while (!stopping && finished < n)
+	{
+	  auto next = std::min_element(devices.begin(), devices.end(),
+				       [](const Device& a, const Device& b)
+				       {return a.due < b.due;});
+
+	  // Sleep in short steps so a signal still stops us
+	  while (!stopping && Clock::now() < next->due)
+	    std::this_thread::sleep_until
+	      (std::min(next->due, Clock::now()
+			+ std::chrono::milliseconds(100)));
+	  if (stopping) break;
+
+	  Device& d = *next;
+	  d.millis += s.transmit;
+
+	  if (s.resetEvery > 0 && d.sent > 0 && d.sent % s.resetEvery == 0)
+	    {
+	      // setup() prints a bare count before any frame
+	      d.millis = s.transmit;
+	      send(d, std::to_string(static_cast<int>(d.counts)) + "\r\n");
+	    }
+
+	  std::string f = makeFrame(d, s, rng);
+	  if (s.corrupt > 0 && percent(rng) < s.corrupt)
+	    corruptFrame(f, rng);
+	  send(d, f);
+	  d.sent++;
+
+	  d.due += std::chrono::duration_cast<Clock::duration>(period);
+	  if (s.frames > 0 && d.sent == s.frames)
+	    {
+	      d.due = Clock::time_point::max();
+	      finished++;
+	    }
+	}
+
+      // Give a reader a moment to take the last frames
+      if (!stopping) std::this_thread::sleep_for(std::chrono::seconds(1));
+
+      unsigned long long frames = 0, bytes = 0, dropped = 0;
+      for (auto it = devices.begin(); it != devices.end(); it++)
+	{
+	  frames += it->sent;
+	  bytes += it->bytes;
+	  dropped += it->dropped;
+	}
+
+      double secs = std::chrono::duration<double>(Clock::now() - start)
+	.count();
+      std::cerr << "Sent " << frames << " frames, " << bytes
+		<< " bytes in " << secs << " s (" << frames / secs
+		<< " frames/s), " << dropped << " bytes dropped"
+		<< std::endl;
+    }
+  catch (std::exception& e)
+    {
+      std::cerr << e.what() << std::endl;
+      for (auto it = devices.begin(); it != devices.end(); it++)
+	if (!it->link.empty()) unlink(it->link.c_str());
+      return -1;
+    }
+
+  for (auto it = devices.begin(); it != devices.end(); it++)
+    {
+      if (!it->link.empty()) unlink(it->link.c_str());
+      close(it->master);
+      close(it->slave);
+    }
+
+  return 0;
+}
@@ -0,0 +1,241 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// metrics.cpp
+
+#include "metrics.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace Filer
+{
+  int Histogram::index(uint64_t ns)
+  {
+    if (ns < subBuckets) return ns;
+
+    // Top bit picks the power of two, the next three the bucket in it
+    int e = 63 - __builtin_clzll(ns);
+    return (e - 2) * subBuckets + ((ns >> (e - 3)) & (subBuckets - 1));
+  }
+
+  uint64_t Histogram::upper(int index)
+  {
+    if (index < subBuckets) return index + 1;
+
+    int e = index / subBuckets + 2;
+    uint64_t sub = index % subBuckets;
+    if (e == 63 && sub == subBuckets - 1) return UINT64_MAX;
+    return (subBuckets + sub + 1) << (e - 3);
+  }
+
+  void Histogram::record(uint64_t ns)
+  {
+    _bucket[index(ns)].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+    _sum.fetch_add(ns, std::memory_order_relaxed);
+
+    uint64_t m = _max.load(std::memory_order_relaxed);
+    while (ns > m && !_max.compare_exchange_weak(m, ns,
+						 std::memory_order_relaxed));
+  }
+
+  uint64_t Histogram::countBelow(uint64_t ns) const
+  {
+    uint64_t n = 0;
+
+    for (int i = 0; i < buckets && upper(i) <= ns; i++)
+      n += _bucket[i].load(std::memory_order_relaxed);
+
+    return n;
+  }
+
+  uint64_t Histogram::quantile(double q) const
+  {
+    uint64_t want = q * count();
+    uint64_t n = 0;
+
+    if (want == 0) want = 1;
+
+    for (int i = 0; i < buckets; i++)
+      {
+	n += _bucket[i].load(std::memory_order_relaxed);
+	if (n >= want) return std::min(upper(i), max());
+      }
+
+    return max();
+  }
+
+  // Upper bounds of the exported buckets, in seconds
+  static const double bounds[] =
+    {0.00001, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5,
+     1, 2.5, 5, 10, 30, 60};
+
+  static void writeHistogram(std::ostream& out, const std::string& name,
+			     const std::string& labels, const Histogram& h)
+  {
+    std::string sep = labels.empty() ? "" : ",";
+    char num[32];
+
+    for (double b : bounds)
+      {
+	snprintf(num, sizeof(num), "%g", b);
+	out << name << "_bucket{" << labels << sep << "le=\"" << num
+	    << "\"} " << h.countBelow(b * 1e9) << "\n";
+      }
+
+    snprintf(num, sizeof(num), "%.9f", h.sum() / 1e9);
+    out << name << "_bucket{" << labels << sep << "le=\"+Inf\"} "
+	<< h.count() << "\n"
+	<< name << "_sum" << (labels.empty() ? "" : "{" + labels + "}")
+	<< " " << num << "\n"
+	<< name << "_count" << (labels.empty() ? "" : "{" + labels + "}")
+	<< " " << h.count() << "\n";
+  }
+
+  static void writeCounter(std::ostream& out, const std::string& name,
+			   const std::string& help, const Counter& c)
+  {
+    out << "# HELP " << name << " " << help << "\n"
+	<< "# TYPE " << name << " counter\n"
+	<< name << " " << c.value() << "\n";
+  }
+
+  void Metrics::write(std::ostream& out)
+  {
+    char num[32];
+    snprintf(num, sizeof(num), "%.3f", lastFrame.load() / 1e3);
+
+    out << "# HELP kittyfiler_stage_seconds Time spent in each stage of "
+      "handling a frame\n"
+	<< "# TYPE kittyfiler_stage_seconds histogram\n";
+    writeHistogram(out, "kittyfiler_stage_seconds", "stage=\"read\"", read);
+    writeHistogram(out, "kittyfiler_stage_seconds", "stage=\"parse\"",
+		   parse);
+    writeHistogram(out, "kittyfiler_stage_seconds", "stage=\"csv\"", csv);
+    writeHistogram(out, "kittyfiler_stage_seconds", "stage=\"binary\"",
+		   binary);
+    writeHistogram(out, "kittyfiler_stage_seconds", "stage=\"db\"", db);
+
+    out << "# HELP kittyfiler_frame_latency_seconds Time from a frame "
+      "being read to every output finishing with it\n"
+	<< "# TYPE kittyfiler_frame_latency_seconds histogram\n";
+    writeHistogram(out, "kittyfiler_frame_latency_seconds", "", latency);
+
+    writeCounter(out, "kittyfiler_frames_total", "Frames read from every "
+		 "device", frames);
+    writeCounter(out, "kittyfiler_rows_total", "Samples parsed from frames",
+		 rows);
+    writeCounter(out, "kittyfiler_read_bytes_total", "Bytes read from "
+		 "every device", bytes);
+    writeCounter(out, "kittyfiler_parse_errors_total", "Frames that could "
+		 "not be parsed", parseErrors);
+    writeCounter(out, "kittyfiler_reconnects_total", "Times the database "
+		 "connection was opened again after breaking", reconnects);
+    writeCounter(out, "kittyfiler_device_closes_total", "Devices that "
+		 "hung up or failed", deviceCloses);
+
+    out << "# HELP kittyfiler_last_frame_timestamp_seconds When the newest "
+      "frame every output has finished with was read\n"
+	<< "# TYPE kittyfiler_last_frame_timestamp_seconds gauge\n"
+	<< "kittyfiler_last_frame_timestamp_seconds " << num << "\n";
+  }
+
+  static void reportHistogram(std::ostream& out, const std::string& name,
+			      const Histogram& h)
+  {
+    if (h.count() == 0) return;
+
+    out << "  " << name << ": " << h.count() << " times, p50 "
+	<< h.quantile(0.5) / 1e3 << " us, p99 "
+	<< h.quantile(0.99) / 1e3 << " us, max "
+	<< h.max() / 1e3 << " us" << std::endl;
+  }
+
+  void Metrics::report(std::ostream& out)
+  {
+    out << "Stages:" << std::endl;
+    reportHistogram(out, "read", read);
+    reportHistogram(out, "parse", parse);
+    reportHistogram(out, "csv", csv);
+    reportHistogram(out, "binary", binary);
+    reportHistogram(out, "db", db);
+    reportHistogram(out, "latency", latency);
+    out << "  " << frames.value() << " frames, " << rows.value()
+	<< " rows, " << bytes.value() << " bytes, " << parseErrors.value()
+	<< " parse errors, " << reconnects.value() << " reconnects"
+	<< std::endl;
+  }
+
+  Metrics& metrics()
+  {
+    static Metrics m;
+    return m;
+  }
+
+  void writeTextfile(const std::string& path, const std::string& text)
+  {
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0;
+    size_t done = 0;
+
+    while (ok && done < text.size())
+      {
+	ssize_t n = ::write(fd, text.data() + done, text.size() - done);
+	if (n < 0 && errno == EINTR) continue;
+	ok = n > 0;
+	if (ok) done += n;
+      }
+
+    if (fd >= 0 && close(fd) < 0) ok = 0;
+    if (ok && rename(tmp.c_str(), path.c_str()) < 0) ok = 0;
+
+    if (!ok)
+      {
+	std::string err = "In Filer::writeTextfile: Could not write ";
+	err += path + ": ";
+	err += strerror(errno);
+	unlink(tmp.c_str());
+	throw std::runtime_error(err);
+      }
+  }
+}
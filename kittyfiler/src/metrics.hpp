@@ -0,0 +1,147 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// metrics.hpp
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#ifndef metrics_hpp
+#define metrics_hpp
+
+namespace Filer
+{
+  /// A count that only goes up, safe to bump from any thread
+  class Counter
+  {
+  public:
+    void add(uint64_t n = 1) {_n.fetch_add(n, std::memory_order_relaxed);};
+    uint64_t value() const {return _n.load(std::memory_order_relaxed);};
+
+  private:
+    std::atomic<uint64_t> _n{0};
+  };
+
+  /// Latencies in nanoseconds, kept HDR style: each power of two is
+  /// split into 8 buckets, so any value is known to within 12.5%
+  /// from 1 ns to centuries. Recording is a few relaxed atomic adds
+  class Histogram
+  {
+  public:
+    static const int subBuckets = 8;
+    static const int buckets = (64 - 2) * subBuckets;
+
+    void record(uint64_t ns);
+
+    uint64_t count() const {return _count.load(std::memory_order_relaxed);};
+    uint64_t sum() const {return _sum.load(std::memory_order_relaxed);};
+    uint64_t max() const {return _max.load(std::memory_order_relaxed);};
+
+    /// Samples at or below ns, counting each bucket whose upper
+    /// bound is at or below it
+    uint64_t countBelow(uint64_t ns) const;
+
+    /// Upper bound of the bucket holding the q quantile, 0 < q <= 1
+    uint64_t quantile(double q) const;
+
+    static int index(uint64_t ns);
+    static uint64_t upper(int index);
+
+  private:
+    std::atomic<uint64_t> _bucket[buckets] = {};
+    std::atomic<uint64_t> _count{0};
+    std::atomic<uint64_t> _sum{0};
+    std::atomic<uint64_t> _max{0};
+  };
+
+  /// Records the time from construction to destruction in a histogram
+  class StageTimer
+  {
+  public:
+    explicit StageTimer(Histogram& h)
+      : _h(h), _start(std::chrono::steady_clock::now()) {};
+    ~StageTimer()
+    {
+      _h.record(std::chrono::duration_cast<std::chrono::nanoseconds>
+		(std::chrono::steady_clock::now() - _start).count());
+    };
+
+  private:
+    Histogram& _h;
+    std::chrono::steady_clock::time_point _start;
+  };
+
+  /// Everything kittyfiler counts while it runs
+  struct Metrics
+  {
+    /// Time in each stage a frame passes through
+    Histogram read;
+    Histogram parse;
+    Histogram csv;
+    Histogram binary;
+    Histogram db;
+    /// From a frame being read to every output being done with it
+    Histogram latency;
+
+    Counter frames;
+    Counter rows;
+    Counter bytes;
+    Counter parseErrors;
+    Counter reconnects;
+    Counter deviceCloses;
+    /// Wall clock ms of the newest frame every output has finished
+    std::atomic<int64_t> lastFrame{0};
+
+    /// Write every metric in Prometheus text format
+    void write(std::ostream& out);
+
+    /// Print the quantiles of each stage for people
+    void report(std::ostream& out);
+  };
+
+  /// The metrics for this process
+  Metrics& metrics();
+
+  /// Replace path with text by writing a temporary file and renaming
+  /// it over, so a reader never sees half of it
+  void writeTextfile(const std::string& path, const std::string& text);
+}
+
+#endif
@@ -0,0 +1,284 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// parser.cpp
+
+#include "parser.hpp"
+#include "connection.hpp"
+#include <cstring>
+
+namespace
+{
+  // Powers of ten that are exact in a double
+  const double _pow10[] =
+    {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+     1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+
+  // Read position in a frame. Every method skips leading whitespace
+  // and returns 0, without consuming anything useful, on input it
+  // does not expect
+  struct Cursor
+  {
+    const char* p;
+    const char* end;
+
+    void skipSpace()
+    {
+      while (p < end && (*p == ' ' || *p == '\t'
+			 || *p == '\r' || *p == '\n'))
+	p++;
+    }
+
+    bool isDigit()
+    {
+      return p < end && *p >= '0' && *p <= '9';
+    }
+
+    bool expect(char c)
+    {
+      skipSpace();
+      if (p < end && *p == c)
+	{
+	  p++;
+	  return 1;
+	}
+      return 0;
+    }
+
+    // Quoted string without escapes
+    bool string(std::string_view& s)
+    {
+      if (!expect('"')) return 0;
+      const char* q = static_cast<const char*>(memchr(p, '"', end - p));
+      if (!q || memchr(p, '\\', q - p)) return 0;
+      s = std::string_view(p, q - p);
+      p = q + 1;
+      return 1;
+    }
+
+    bool key(std::string_view& k)
+    {
+      return string(k) && expect(':');
+    }
+
+    bool integer(long long& v)
+    {
+      skipSpace();
+      bool neg = expect('-');
+      if (!isDigit()) return 0;
+
+      long long m = 0;
+      for (int n = 0; isDigit(); n++, p++)
+	{
+	  if (n == 18) return 0;
+	  m = m * 10 + (*p - '0');
+	}
+
+      // A fraction or exponent means this wasn't an integer
+      if (p < end && (*p == '.' || *p == 'e' || *p == 'E')) return 0;
+
+      v = neg ? -m : m;
+      return 1;
+    }
+
+    // Decimal number of up to 15 significant digits. Both the digits
+    // and the power of ten are exact doubles, so the one division is
+    // correctly rounded, same as strtod
+    bool number(double& v)
+    {
+      skipSpace();
+      bool neg = expect('-');
+      if (!isDigit()) return 0;
+
+      long long m = 0;
+      int digits = 0;
+      int frac = 0;
+      for (; isDigit(); p++)
+	if (++digits <= 15) m = m * 10 + (*p - '0');
+      if (p < end && *p == '.')
+	{
+	  p++;
+	  if (!isDigit()) return 0;
+	  for (; isDigit(); p++, frac++)
+	    if (++digits <= 15) m = m * 10 + (*p - '0');
+	}
+
+      if (digits > 15) return 0;
+      if (p < end && (*p == 'e' || *p == 'E')) return 0;
+
+      v = m / _pow10[frac];
+      if (neg) v = -v;
+      return 1;
+    }
+
+    bool boolean(bool& v)
+    {
+      skipSpace();
+      if (end - p >= 4 && memcmp(p, "true", 4) == 0)
+	{
+	  p += 4;
+	  v = 1;
+	  return 1;
+	}
+      if (end - p >= 5 && memcmp(p, "false", 5) == 0)
+	{
+	  p += 5;
+	  v = 0;
+	  return 1;
+	}
+      return 0;
+    }
+  };
+
+  // One {"value": ..., "timemillis": ..., "iswarmedup": ...} element
+  bool _sample(Cursor& c, Filer::AmmoniaBatch& batch,
+	       const Filer::FrameInfo& info, long long sentmillis)
+  {
+    double value = 0;
+    long long timemillis = 0;
+    bool warmedup = 0;
+    int seen = 0;
+
+    if (!c.expect('{')) return 0;
+
+    do
+      {
+	std::string_view k;
+	if (!c.key(k)) return 0;
+
+	if (k == "value")
+	  {
+	    if (!c.number(value)) return 0;
+	    seen |= 1;
+	  }
+	else if (k == "timemillis")
+	  {
+	    if (!c.integer(timemillis)) return 0;
+	    seen |= 2;
+	  }
+	else if (k == "iswarmedup")
+	  {
+	    if (!c.boolean(warmedup)) return 0;
+	    seen |= 4;
+	  }
+	else return 0;
+      }
+    while (c.expect(','));
+
+    if (!c.expect('}') || seen != 7) return 0;
+
+    batch.push(info, sentmillis, timemillis, value, warmedup);
+    return 1;
+  }
+}
+
+namespace Filer
+{
+  int FrameParser::parse(std::string_view frame, AmmoniaBatch& batch,
+			 const FrameInfo& info, std::ostream& err)
+  {
+    int n = parseFast(frame, batch, info);
+    if (n >= 0) return n;
+
+    // Something unusual, let the full Json parser have a go
+    return Conversion::jsonToBatch(frame, batch, info, err);
+  }
+
+  int FrameParser::parseFast(std::string_view frame, AmmoniaBatch& batch,
+			     const FrameInfo& info)
+  {
+    Cursor c = {frame.data(), frame.data() + frame.size()};
+    size_t start = batch.size();
+    long long sentmillis = 0;
+    bool haveSent = 0;
+    bool ok = c.expect('{');
+
+    while (ok)
+      {
+	std::string_view k;
+	if (!c.key(k))
+	  {
+	    ok = 0;
+	    break;
+	  }
+
+	if (k == "project")
+	  {
+	    std::string_view project;
+	    ok = c.string(project);
+	  }
+	else if (k == "sentmillis")
+	  {
+	    ok = c.integer(sentmillis);
+	    haveSent = ok;
+	  }
+	else if (k == "data")
+	  {
+	    // Samples need sentmillis, which the sketch sends first
+	    ok = haveSent && c.expect('[');
+	    if (ok && !c.expect(']'))
+	      {
+		do ok = _sample(c, batch, info, sentmillis);
+		while (ok && c.expect(','));
+		ok = ok && c.expect(']');
+	      }
+	  }
+	else if (k == "EOT")
+	  {
+	    bool eot;
+	    ok = c.boolean(eot);
+	  }
+	else ok = 0;
+
+	if (ok && !c.expect(','))
+	  {
+	    ok = c.expect('}');
+	    break;
+	  }
+      }
+
+    // Nothing but whitespace may follow the closing brace
+    c.skipSpace();
+    if (!ok || !haveSent || c.p != c.end)
+      {
+	batch.truncate(start);
+	return -1;
+      }
+
+    return batch.size() - start;
+  }
+}
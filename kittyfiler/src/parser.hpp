@@ -0,0 +1,68 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// parser.hpp
+
+#include <iostream>
+#include <string_view>
+#include "batch.hpp"
+
+#ifndef parser_hpp
+#define parser_hpp
+
+namespace Filer
+{
+  /// Single pass parser for the frames sent by the kittycomfort
+  /// sketch. It reads the frame in place and writes samples straight
+  /// into the batch, so a warmed up batch costs no allocations
+  class FrameParser
+  {
+  public:
+    /// Parse frame into batch, stamping each sample with info.
+    /// Frames the fast path doesn't recognize are handed to jsoncpp.
+    /// Returns samples added, or -1 if the frame is bad
+    static int parse(std::string_view frame, AmmoniaBatch& batch,
+		     const FrameInfo& info, std::ostream& err = std::cerr);
+
+    /// Fast path only. Returns -1 and leaves batch untouched on any
+    /// input that isn't shaped like a kittycomfort frame
+    static int parseFast(std::string_view frame, AmmoniaBatch& batch,
+			 const FrameInfo& info);
+  };
+}
+
+#endif
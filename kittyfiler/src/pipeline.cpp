@@ -0,0 +1,419 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// pipeline.cpp
+
+#include "pipeline.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include <chrono>
+#include <stdexcept>
+
+namespace Filer
+{
+  void Frame::retain()
+  {
+    _refs.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void Frame::release()
+  {
+    if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      {
+	// Every output is done with it
+	Metrics& m = metrics();
+	m.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>
+			 (std::chrono::steady_clock::now() - received)
+			 .count());
+	int64_t t = readtime / 1000000;
+	int64_t was = m.lastFrame.load(std::memory_order_relaxed);
+	while (t > was && !m.lastFrame.compare_exchange_weak(was, t));
+	delete this;
+      }
+  }
+
+  Sink::policy Sink::parsePolicy(const std::string& name)
+  {
+    if (name == "block") return BLOCK;
+    if (name == "drop") return DROP_OLDEST;
+    if (name == "spill") return SPILL;
+
+    std::string e = "In Sink::parsePolicy: Unknown policy ";
+    e += name;
+    throw std::runtime_error(e);
+  }
+
+  const char* Sink::policyName(policy p)
+  {
+    switch (p)
+      {
+      case BLOCK: return "block";
+      case DROP_OLDEST: return "drop";
+      case SPILL: return "spill";
+      }
+    return "";
+  }
+
+  Sink::Sink(const std::string& name,
+	     std::function<void(const Frame&)> write,
+	     policy p, size_t depth, size_t spill)
+    : _name(name), _write(write), _policy(p), _queue(depth),
+      _spillLimit(spill)
+  {
+  }
+
+  Sink::~Sink()
+  {
+    stop();
+
+    // Nothing ran the queue, so let go of what is left
+    Frame* f;
+    while ((f = _take())) f->release();
+  }
+
+  void Sink::start()
+  {
+    if (!_thread.joinable())
+      _thread = std::thread(&Sink::_run, this);
+  }
+
+  void Sink::stop()
+  {
+    if (!_thread.joinable()) return;
+    _stopping = 1;
+    _notify();
+    _thread.join();
+  }
+
+  void Sink::offer(Frame* f)
+  {
+    _accepted++;
+
+    // A dead output would never make room
+    if (_failed)
+      {
+	_dropped++;
+	f->release();
+	return;
+      }
+
+    // Once spilling, keep spilling until the overflow is drained so
+    // frames stay in order
+    if (_spilling || !_queue.push(f))
+      {
+	switch (_policy)
+	  {
+	  case BLOCK:
+	    {
+	      // Sleep until the worker takes a frame or fails. Holding
+	      // the lock from the push to the wait means its wakeup
+	      // can't slip in between
+	      std::unique_lock<std::mutex> lock(_roomLock);
+	      _blocked = 1;
+	      std::atomic_thread_fence(std::memory_order_seq_cst);
+	      while (!_queue.push(f))
+		{
+		  if (_failed)
+		    {
+		      _blocked = 0;
+		      _dropped++;
+		      f->release();
+		      return;
+		    }
+		  _notify();
+		  _room.wait(lock);
+		}
+	      _blocked = 0;
+	    }
+	    break;
+
+	  case DROP_OLDEST:
+	    while (!_queue.push(f))
+	      {
+		Frame* old = _queue.pop();
+		if (old)
+		  {
+		    _dropped++;
+		    old->release();
+		  }
+	      }
+	    break;
+
+	  case SPILL:
+	    {
+	      // At the limit, fall back to dropping the oldest spilled
+	      // frame rather than growing without end
+	      std::lock_guard<std::mutex> guard(_overflowLock);
+	      if (_overflow.size() >= _spillLimit && !_overflow.empty())
+		{
+		  _overflow.front()->release();
+		  _overflow.pop_front();
+		  _dropped++;
+		}
+	      _overflow.push_back(f);
+	      _spilling = 1;
+	    }
+	    _spilled++;
+	    break;
+	  }
+      }
+
+    size_t d = depth();
+    if (d > _maxDepth) _maxDepth = d;
+    _notify();
+  }
+
+  size_t Sink::depth()
+  {
+    size_t d = _queue.size();
+    if (_spilling)
+      {
+	std::lock_guard<std::mutex> guard(_overflowLock);
+	d += _overflow.size();
+      }
+    return d;
+  }
+
+  std::string Sink::error()
+  {
+    if (!_failed) return std::string();
+    return _error;
+  }
+
+  // Oldest frame first: the ring always holds frames older than the
+  // overflow list
+  Frame* Sink::_take()
+  {
+    Frame* f = _queue.pop();
+    if (f || !_spilling) return f;
+
+    std::lock_guard<std::mutex> guard(_overflowLock);
+    if (!_overflow.empty())
+      {
+	f = _overflow.front();
+	_overflow.pop_front();
+      }
+    if (_overflow.empty()) _spilling = 0;
+    return f;
+  }
+
+  void Sink::_notify()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_sleeping)
+      {
+	std::lock_guard<std::mutex> guard(_wakeLock);
+	_wake.notify_one();
+      }
+  }
+
+  // Wake the reader if it is waiting for room in the queue
+  void Sink::_madeRoom()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_blocked)
+      {
+	std::lock_guard<std::mutex> guard(_roomLock);
+	_room.notify_one();
+      }
+  }
+
+  void Sink::_run()
+  {
+    // Spans need a name that outlives the sink
+    std::string_view span = AmmoniaBatch::intern("sink " + _name);
+    Trace::nameThread(std::string(span));
+
+    for (;;)
+      {
+	Frame* f = _take();
+
+	if (!f)
+	  {
+	    if (_stopping)
+	      {
+		// Frames may have landed after the last look
+		f = _take();
+		if (!f) break;
+	      }
+	    else
+	      {
+		std::unique_lock<std::mutex> lock(_wakeLock);
+		_sleeping = 1;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (_queue.size() == 0 && !_spilling && !_stopping)
+		  _wake.wait_for(lock, std::chrono::milliseconds(100));
+		_sleeping = 0;
+		lock.unlock();
+
+		if (_idle && !_failed)
+		  {
+		    try
+		      {
+			_idle();
+		      }
+		    catch (std::exception& e)
+		      {
+			_fail(e);
+		      }
+		  }
+		continue;
+	      }
+	  }
+
+	_madeRoom();
+
+	if (_failed) _dropped++;
+	else
+	  {
+	    try
+	      {
+		TraceSpan write(span, "frame", f->seq);
+		_write(*f);
+		_written++;
+	      }
+	    catch (std::exception& e)
+	      {
+		_fail(e);
+	      }
+	  }
+
+	f->release();
+      }
+  }
+
+  void Sink::_fail(const std::exception& e)
+  {
+    _error = "In sink ";
+    _error += _name;
+    _error += ": ";
+    _error += e.what();
+    _failed = 1;
+    _madeRoom();
+  }
+
+  Pipeline::Pipeline()
+  {
+  }
+
+  Pipeline::~Pipeline()
+  {
+    stop();
+    for (auto it = _sinks.begin(); it != _sinks.end(); it++)
+      delete *it;
+  }
+
+  Sink& Pipeline::add(Sink* s)
+  {
+    _sinks.push_back(s);
+    return *s;
+  }
+
+  void Pipeline::start()
+  {
+    for (auto it = _sinks.begin(); it != _sinks.end(); it++)
+      (*it)->start();
+  }
+
+  void Pipeline::stop()
+  {
+    for (auto it = _sinks.begin(); it != _sinks.end(); it++)
+      (*it)->stop();
+  }
+
+  void Pipeline::offer(Frame* f)
+  {
+    for (auto it = _sinks.begin(); it != _sinks.end(); it++)
+      {
+	f->retain();
+	(*it)->offer(f);
+      }
+    f->release();
+  }
+
+  bool Pipeline::failed()
+  {
+    for (auto it = _sinks.begin(); it != _sinks.end(); it++)
+      if ((*it)->failed()) return 1;
+    return 0;
+  }
+
+  std::string Pipeline::error()
+  {
+    for (auto it = _sinks.begin(); it != _sinks.end(); it++)
+      if ((*it)->failed()) return (*it)->error();
+    return std::string();
+  }
+
+  void Pipeline::report(std::ostream& out)
+  {
+    for (auto it = _sinks.begin(); it != _sinks.end(); it++)
+      {
+	Sink& s = **it;
+	out << "sink " << s.name()
+	    << " policy=" << Sink::policyName(s.backpressure())
+	    << " depth=" << s.depth() << "/" << s.capacity()
+	    << " max=" << s.maxDepth()
+	    << " accepted=" << s.accepted()
+	    << " written=" << s.written()
+	    << " dropped=" << s.dropped()
+	    << " spilled=" << s.spilled() << std::endl;
+      }
+  }
+
+  void Pipeline::writeMetrics(std::ostream& out)
+  {
+    out << "# HELP kittyfiler_sink_queue_depth Frames waiting for each "
+      "output\n"
+	<< "# TYPE kittyfiler_sink_queue_depth gauge\n";
+    for (auto it = _sinks.begin(); it != _sinks.end(); it++)
+      out << "kittyfiler_sink_queue_depth{sink=\"" << (*it)->name()
+	  << "\"} " << (*it)->depth() << "\n";
+
+    out << "# HELP kittyfiler_sink_frames_total Frames handled by each "
+      "output, by what became of them\n"
+	<< "# TYPE kittyfiler_sink_frames_total counter\n";
+    for (auto it = _sinks.begin(); it != _sinks.end(); it++)
+      {
+	Sink& s = **it;
+	std::string sink = "kittyfiler_sink_frames_total{sink=\"" + s.name();
+	out << sink << "\",result=\"written\"} " << s.written() << "\n"
+	    << sink << "\",result=\"dropped\"} " << s.dropped() << "\n"
+	    << sink << "\",result=\"spilled\"} " << s.spilled() << "\n";
+      }
+  }
+}
@@ -0,0 +1,201 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// pipeline.hpp
+
+#include "batch.hpp"
+#include "queue.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef pipeline_hpp
+#define pipeline_hpp
+
+namespace Filer
+{
+  /// One frame on its way to the sinks, shared by all of them and
+  /// freed when the last one lets go
+  struct Frame
+  {
+    /// The frame as read, terminator included
+    std::string raw;
+    /// Parsed samples, empty if no sink needs them
+    AmmoniaBatch batch;
+    /// When the frame was read, for the end to end latency
+    std::chrono::steady_clock::time_point received;
+    /// Host time the frame was read, nanoseconds since the epoch
+    long long readtime = 0;
+    /// Count of frames read before this one, to follow it through a
+    /// trace
+    unsigned long long seq = 0;
+
+    void retain();
+    void release();
+
+  private:
+    std::atomic<int> _refs{1};
+  };
+
+  /// An output running on its own thread, fed through a bounded
+  /// queue so a slow output never holds up the serial ports
+  class Sink
+  {
+  public:
+    /// What to do with a frame when the queue is full
+    enum policy
+      {
+	BLOCK,       ///< Wait for room, holding up the reader
+	DROP_OLDEST, ///< Throw away the oldest queued frame
+	SPILL        ///< Keep it in an overflow list of up to spill
+		     ///< frames, then drop the oldest spilled frame
+      };
+
+    /// Parse a policy name: block, drop or spill
+    static policy parsePolicy(const std::string& name);
+    static const char* policyName(policy p);
+
+    Sink(const std::string& name, std::function<void(const Frame&)> write,
+	 policy p = BLOCK, size_t depth = 64, size_t spill = 16384);
+    Sink(const Sink& o) = delete;
+    ~Sink();
+
+    /// Run f on the worker each time it wakes with nothing queued,
+    /// at least every 100 ms. Set before start
+    void onIdle(std::function<void()> f) {_idle = f;};
+
+    /// Start the worker thread
+    void start();
+
+    /// Let the worker finish every queued frame, then join it
+    void stop();
+
+    /// Queue a frame for this sink. Called only from the reader
+    void offer(Frame* f);
+
+    const std::string& name() {return _name;};
+    policy backpressure() {return _policy;};
+
+    /// Frames in the queue and overflow list right now
+    size_t depth();
+    size_t maxDepth() {return _maxDepth;};
+    size_t capacity() {return _queue.capacity();};
+    unsigned long long accepted() {return _accepted;};
+    unsigned long long written() {return _written;};
+    unsigned long long dropped() {return _dropped;};
+    unsigned long long spilled() {return _spilled;};
+
+    /// Check if the output threw. The worker stops when it does
+    bool failed() {return _failed;};
+    std::string error();
+
+  private:
+    std::string _name;
+    std::function<void(const Frame&)> _write;
+    std::function<void()> _idle;
+    policy _policy;
+    RingQueue<Frame> _queue;
+    std::deque<Frame*> _overflow;
+    size_t _spillLimit;
+    std::mutex _overflowLock;
+    std::atomic<bool> _spilling{0};
+    std::mutex _roomLock;
+    std::condition_variable _room;
+    std::atomic<bool> _blocked{0};
+    std::thread _thread;
+    std::mutex _wakeLock;
+    std::condition_variable _wake;
+    std::atomic<bool> _sleeping{0};
+    std::atomic<bool> _stopping{0};
+    std::atomic<bool> _failed{0};
+    std::string _error;
+    std::atomic<size_t> _maxDepth{0};
+    std::atomic<unsigned long long> _accepted{0};
+    std::atomic<unsigned long long> _written{0};
+    std::atomic<unsigned long long> _dropped{0};
+    std::atomic<unsigned long long> _spilled{0};
+    Frame* _take();
+    void _notify();
+    void _madeRoom();
+    void _fail(const std::exception& e);
+    void _run();
+  };
+
+  /// The set of sinks every frame is handed to
+  class Pipeline
+  {
+  public:
+    Pipeline();
+    Pipeline(const Pipeline& o) = delete;
+    ~Pipeline();
+
+    /// Add a sink. The pipeline owns it from here on
+    Sink& add(Sink* s);
+
+    void start();
+
+    /// Drain and join every sink
+    void stop();
+
+    /// Give frame to every sink, dropping the caller's reference
+    void offer(Frame* f);
+
+    /// Check if any sink has failed
+    bool failed();
+
+    /// Error of the first failed sink
+    std::string error();
+
+    /// Print queue depths and counters for every sink
+    void report(std::ostream& out);
+
+    /// Write the same in Prometheus text format
+    void writeMetrics(std::ostream& out);
+
+  private:
+    std::vector<Sink*> _sinks;
+  };
+}
+
+#endif
@@ -0,0 +1,155 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// poller.cpp
+
+#include "poller.hpp"
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace Filer
+{
+#ifdef __linux__
+  Poller::Poller()
+    : _epfd(epoll_create1(EPOLL_CLOEXEC))
+  {
+    if (_epfd < 0)
+      {
+	std::string e = "In Poller::Poller: ";
+	e += strerror(errno);
+	throw std::runtime_error(e);
+      }
+  }
+
+  Poller::~Poller()
+  {
+    close(_epfd);
+  }
+
+  void Poller::add(int fd, size_t tag)
+  {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = tag;
+    if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+      {
+	std::string e = "In Poller::add: ";
+	e += strerror(errno);
+	throw std::runtime_error(e);
+      }
+    _count++;
+    _events.resize(_count);
+  }
+
+  void Poller::remove(int fd)
+  {
+    if (epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL) == 0) _count--;
+  }
+
+  int Poller::wait(std::vector<size_t>& ready, int timeout)
+  {
+    ready.clear();
+    if (_events.empty()) _events.resize(1);
+
+    int n = epoll_wait(_epfd, _events.data(), _events.size(), timeout);
+    if (n < 0 && errno != EINTR)
+      {
+	std::string e = "In Poller::wait: ";
+	e += strerror(errno);
+	throw std::runtime_error(e);
+      }
+
+    for (int i = 0; i < n; i++)
+      ready.push_back(_events[i].data.u64);
+
+    return n < 0 ? 0 : n;
+  }
+#else
+  Poller::Poller()
+  {
+  }
+
+  Poller::~Poller()
+  {
+  }
+
+  void Poller::add(int fd, size_t tag)
+  {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    _fds.push_back(pfd);
+    _tags.push_back(tag);
+    _count++;
+  }
+
+  void Poller::remove(int fd)
+  {
+    for (size_t i = 0; i < _fds.size(); i++)
+      if (_fds[i].fd == fd)
+	{
+	  _fds.erase(_fds.begin() + i);
+	  _tags.erase(_tags.begin() + i);
+	  _count--;
+	  return;
+	}
+  }
+
+  int Poller::wait(std::vector<size_t>& ready, int timeout)
+  {
+    ready.clear();
+
+    int n = poll(_fds.data(), _fds.size(), timeout);
+    if (n < 0 && errno != EINTR)
+      {
+	std::string e = "In Poller::wait: ";
+	e += strerror(errno);
+	throw std::runtime_error(e);
+      }
+
+    for (size_t i = 0; n > 0 && i < _fds.size(); i++)
+      if (_fds[i].revents)
+	ready.push_back(_tags[i]);
+
+    return ready.size();
+  }
+#endif
+}
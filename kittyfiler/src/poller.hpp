@@ -0,0 +1,88 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// poller.hpp
+
+#include <vector>
+#include <cstddef>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#ifndef poller_hpp
+#define poller_hpp
+
+namespace Filer
+{
+  /// Wait for input on many file descriptors at once. Uses epoll on
+  /// Linux and poll everywhere else
+  class Poller
+  {
+  public:
+    Poller();
+    Poller(const Poller& o) = delete;
+    ~Poller();
+
+    /// Watch fd for input. tag is handed back when fd is ready
+    void add(int fd, size_t tag);
+
+    /// Stop watching fd
+    void remove(int fd);
+
+    /// Number of descriptors watched
+    size_t size() {return _count;};
+
+    /// Wait up to timeout ms and put the tags of readable descriptors
+    /// in ready. Returns how many are ready, 0 on timeout or signal
+    int wait(std::vector<size_t>& ready, int timeout);
+
+  private:
+    size_t _count = 0;
+#ifdef __linux__
+    int _epfd;
+    std::vector<struct epoll_event> _events;
+#else
+    std::vector<struct pollfd> _fds;
+    std::vector<size_t> _tags;
+#endif
+  };
+}
+
+#endif
@@ -0,0 +1,110 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// queue.hpp
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+#ifndef queue_hpp
+#define queue_hpp
+
+namespace Filer
+{
+  /// Bounded lock-free ring of pointers for one producer and one
+  /// consumer. pop may also be called by the producer, to make room
+  /// by dropping the oldest entry
+  template<typename T>
+  class RingQueue
+  {
+  public:
+    /// Capacity is rounded up to a power of two
+    explicit RingQueue(size_t capacity)
+    {
+      size_t cap = 1;
+      while (cap < capacity) cap <<= 1;
+      _slots.reset(new std::atomic<T*>[cap]);
+      _mask = cap - 1;
+    }
+
+    RingQueue(const RingQueue& o) = delete;
+
+    /// Add item at the tail. Returns 0 if the ring is full
+    bool push(T* item)
+    {
+      size_t t = _tail.load(std::memory_order_relaxed);
+      if (t - _head.load(std::memory_order_acquire) > _mask) return 0;
+      _slots[t & _mask].store(item, std::memory_order_relaxed);
+      _tail.store(t + 1, std::memory_order_release);
+      return 1;
+    }
+
+    /// Take the item at the head, NULL if the ring is empty. The
+    /// head only moves by compare and swap, so a consumer that races
+    /// the producer dropping an entry simply retries
+    T* pop()
+    {
+      size_t h = _head.load(std::memory_order_acquire);
+      for (;;)
+	{
+	  if (h == _tail.load(std::memory_order_acquire)) return NULL;
+	  T* item = _slots[h & _mask].load(std::memory_order_relaxed);
+	  if (_head.compare_exchange_weak(h, h + 1,
+					  std::memory_order_acq_rel))
+	    return item;
+	}
+    }
+
+    /// Number of items waiting
+    size_t size() const
+    {
+      return _tail.load(std::memory_order_acquire)
+	- _head.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const {return _mask + 1;};
+
+  private:
+    std::unique_ptr<std::atomic<T*>[]> _slots;
+    size_t _mask;
+    alignas(64) std::atomic<size_t> _head{0};
+    alignas(64) std::atomic<size_t> _tail{0};
+  };
+}
+
+#endif
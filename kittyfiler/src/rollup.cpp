@@ -0,0 +1,86 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// rollup.cpp
+
+#include "rollup.hpp"
+
+namespace Filer
+{
+  Rollup::Rollup(const std::string& table, long long width,
+		 long long grace)
+    : _table(table), _width(width), _grace(grace)
+  {
+  }
+
+  void Rollup::add(const AmmoniaBatch& batch)
+  {
+    for (size_t i = 0; i < batch.size(); i++)
+      {
+	long long t = batch.esttime[i] ? batch.esttime[i] : batch.readtime[i];
+
+	// Round down, also for times before the epoch
+	long long start = t / _width * _width;
+	if (t < start) start -= _width;
+
+	_open.insert(key(batch.device[i], start));
+      }
+  }
+
+  void Rollup::close(long long now, bool all)
+  {
+    for (auto it = _open.begin(); it != _open.end();)
+      {
+	if (!all && it->second + _width + _grace > now)
+	  {
+	    it++;
+	    continue;
+	  }
+
+	_closed.insert(*it);
+	it = _open.erase(it);
+      }
+  }
+
+  std::vector<RollupBucket> Rollup::pending() const
+  {
+    std::vector<RollupBucket> out;
+    out.reserve(_closed.size());
+    for (auto it = _closed.begin(); it != _closed.end(); it++)
+      out.push_back({it->first, it->second});
+    return out;
+  }
+}
@@ -0,0 +1,106 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// rollup.hpp
+
+#include "batch.hpp"
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#ifndef rollup_hpp
+#define rollup_hpp
+
+namespace Filer
+{
+  /// One device's stretch of sample time in a rollup table
+  struct RollupBucket
+  {
+    /// Interned name of the device
+    std::string_view device;
+    /// Start of the bucket, nanoseconds since the epoch
+    long long start = 0;
+  };
+
+  /// Keeps track of which per device buckets of fixed width have had
+  /// samples stored, and hands each out once it is over to be summed
+  /// up again from the sample table. Summing what the table holds,
+  /// rather than keeping running totals, counts every sample once
+  /// however often it was sent, and leaves out samples the database
+  /// refused. A bucket that gets more samples after it was stored is
+  /// simply summed up again
+  class Rollup
+  {
+  public:
+    /// Buckets width nanoseconds wide, each closed once grace has
+    /// passed since it ended. Stored in table
+    Rollup(const std::string& table, long long width, long long grace);
+
+    const std::string& table() const {return _table;};
+    long long width() const {return _width;};
+
+    /// Note the bucket of every sample of batch, at its estimated
+    /// time if known and its read time otherwise
+    void add(const AmmoniaBatch& batch);
+
+    /// Close every bucket that ended grace before now, or every
+    /// bucket at all with all set
+    void close(long long now, bool all = 0);
+
+    /// Closed buckets not yet stored
+    std::vector<RollupBucket> pending() const;
+
+    /// Forget the closed buckets once pending has been stored
+    void stored() {_closed.clear();};
+
+    /// Number of buckets still open and closed but not stored
+    size_t open() const {return _open.size();};
+    size_t waiting() const {return _closed.size();};
+
+  private:
+    typedef std::pair<std::string_view, long long> key;
+
+    std::string _table;
+    long long _width;
+    long long _grace;
+    std::set<key> _open;
+    std::set<key> _closed;
+  };
+}
+
+#endif
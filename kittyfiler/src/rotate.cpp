@@ -0,0 +1,303 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// rotate.cpp
+
+#include "rotate.hpp"
+#include "cli.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace Filer
+{
+  // Number with an optional unit suffix, each unit scaling by its
+  // entry in scale
+  static unsigned long long withUnit(const std::string& s,
+				     const std::string& units,
+				     const unsigned long long* scale)
+  {
+    size_t end = 0;
+    unsigned long long n = std::stoull(s, &end);
+    if (end == s.size()) return n;
+
+    size_t u = units.find(s[end]);
+    if (end + 1 != s.size() || u == std::string::npos)
+      {
+	std::string err = "In Filer::RotatePolicy::parse: Bad value ";
+	err += s;
+	throw std::runtime_error(err);
+      }
+
+    return n * scale[u];
+  }
+
+  RotatePolicy RotatePolicy::parse(const std::string& spec)
+  {
+    static const unsigned long long sizes[] = {1ULL << 10, 1ULL << 20,
+					       1ULL << 30};
+    static const unsigned long long times[] = {1, 60, 3600, 86400};
+    RotatePolicy p;
+
+    std::map<std::string, std::string> pairs = Cli::splitPairs(spec);
+    for (auto it = pairs.begin(); it != pairs.end(); it++)
+      {
+	if (it->first == "size")
+	  p.bytes = withUnit(it->second, "KMG", sizes);
+	else if (it->first == "interval")
+	  p.seconds = withUnit(it->second, "smhd", times);
+	else if (it->first == "compress" && it->second == "gzip")
+	  p.compress = 1;
+	else if (it->first == "compress" && it->second == "none")
+	  p.compress = 0;
+	else
+	  {
+	    std::string err = "In Filer::RotatePolicy::parse: ";
+	    err += "Unknown rotation setting ";
+	    err += it->first + "=" + it->second;
+	    throw std::runtime_error(err);
+	  }
+      }
+
+    return p;
+  }
+
+  Compressor::Compressor()
+  {
+    _thread = std::thread(&Compressor::_run, this);
+  }
+
+  Compressor::~Compressor()
+  {
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+      _stopping = 1;
+    }
+    _wake.notify_all();
+    _thread.join();
+  }
+
+  void Compressor::add(const std::string& path)
+  {
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+      _queue.push_back(path);
+    }
+    _wake.notify_all();
+  }
+
+  void Compressor::_run()
+  {
+    for (;;)
+      {
+	std::string path;
+
+	{
+	  std::unique_lock<std::mutex> guard(_lock);
+	  _wake.wait(guard, [this] {return _stopping || !_queue.empty();});
+	  if (_queue.empty()) return;
+	  path = _queue.front();
+	  _queue.pop_front();
+	}
+
+	// A file that fails to compress is left as it is
+	try
+	  {
+	    _gzip(path);
+	  }
+	catch (std::exception& e)
+	  {
+	    std::cerr << e.what() << std::endl;
+	  }
+      }
+  }
+
+  // Write path.gz next to path, then swap it in. The original is only
+  // removed once the compressed copy is safely on disk
+  void Compressor::_gzip(const std::string& path)
+  {
+    std::string gz = path + ".gz";
+    std::string tmp = gz + ".tmp";
+
+    int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    gzFile out = in < 0 ? NULL : gzopen(tmp.c_str(), "wb");
+
+    if (!out)
+      {
+	if (in >= 0) close(in);
+	std::string err = "In Filer::Compressor::_gzip: Could not open ";
+	err += in < 0 ? path : tmp;
+	throw std::runtime_error(err);
+      }
+
+    char chunk[64 << 10];
+    ssize_t n;
+    bool good = 1;
+    while ((n = read(in, chunk, sizeof(chunk))) > 0)
+      if (gzwrite(out, chunk, n) != n)
+	{
+	  good = 0;
+	  break;
+	}
+
+    close(in);
+    if (gzclose(out) != Z_OK || n < 0) good = 0;
+
+    int fd = open(tmp.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fsync(fd) < 0) good = 0;
+    if (fd >= 0) close(fd);
+
+    if (!good || rename(tmp.c_str(), gz.c_str()) < 0)
+      {
+	unlink(tmp.c_str());
+	std::string err = "In Filer::Compressor::_gzip: Could not compress ";
+	err += path;
+	throw std::runtime_error(err);
+      }
+
+    unlink(path.c_str());
+  }
+
+  Rotator::Rotator(const std::string& path, const RotatePolicy& policy,
+		   Compressor* compressor)
+    :_path(path), _policy(policy), _compressor(compressor)
+  {
+    // Samples left from an earlier run are kept in the active file,
+    // dated from when it was last written
+    struct stat st;
+    if (stat(_path.c_str(), &st) == 0 && st.st_size > 0)
+      {
+	_bytes = st.st_size;
+	_held = 1;
+	_first = _last = st.st_mtime * 1000000000LL;
+      }
+
+    _schedule();
+  }
+
+  void Rotator::_schedule()
+  {
+    if (_policy.seconds == 0) return;
+
+    // Line rotations up with the clock, so hourly files start on
+    // the hour
+    long long now = time(NULL);
+    long long next = (now / _policy.seconds + 1) * _policy.seconds;
+    _deadline = std::chrono::system_clock::from_time_t(next);
+  }
+
+  void Rotator::saw(const AmmoniaBatch& batch)
+  {
+    if (batch.empty()) return;
+
+    auto range = std::minmax_element(batch.readtime.begin(),
+				     batch.readtime.end());
+    if (!_held || *range.first < _first) _first = *range.first;
+    if (!_held || *range.second > _last) _last = *range.second;
+    _held = 1;
+  }
+
+  bool Rotator::due()
+  {
+    if (_policy.bytes > 0 && _bytes >= _policy.bytes && _held)
+      return 1;
+
+    if (_policy.seconds > 0
+	&& std::chrono::system_clock::now() >= _deadline)
+      {
+	// Nothing to close off yet, so wait for the next boundary
+	if (!_held) _schedule();
+	return _held;
+      }
+
+    return 0;
+  }
+
+  std::string Rotator::_segmentName()
+  {
+    auto stamp = [](long long ns)
+    {
+      time_t tt = ns / 1000000000;
+      struct tm ttm;
+      char out[32];
+      gmtime_r(&tt, &ttm);
+      strftime(out, sizeof(out), "%Y%m%dT%H%M%SZ", &ttm);
+      return std::string(out);
+    };
+
+    std::filesystem::path p(_path);
+    std::string base = (p.parent_path() / p.stem()).string();
+    base += "." + stamp(_first) + "-" + stamp(_last);
+    std::string ext = p.extension().string();
+
+    // Two segments can cover the same second
+    std::string name = base + ext;
+    for (int i = 1; access(name.c_str(), F_OK) == 0
+	   || access((name + ".gz").c_str(), F_OK) == 0; i++)
+      name = base + "." + std::to_string(i) + ext;
+
+    return name;
+  }
+
+  void Rotator::rotate()
+  {
+    std::string name = _segmentName();
+
+    if (rename(_path.c_str(), name.c_str()) < 0)
+      {
+	std::string err = "In Filer::Rotator::rotate: Could not rename ";
+	err += _path + " to " + name + ": ";
+	err += strerror(errno);
+	throw std::runtime_error(err);
+      }
+
+    if (_policy.compress && _compressor) _compressor->add(name);
+
+    _bytes = 0;
+    _held = 0;
+    _schedule();
+  }
+}
@@ -0,0 +1,130 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// rotate.hpp
+
+#include "batch.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifndef rotate_hpp
+#define rotate_hpp
+
+namespace Filer
+{
+  /// When an output file is closed off and started again
+  struct RotatePolicy
+  {
+    /// Rotate once the file holds this many bytes, 0 for never
+    size_t bytes = 0;
+    /// Rotate on every multiple of this many seconds since the
+    /// epoch, 0 for never
+    unsigned seconds = 0;
+    /// Gzip closed files in the background
+    bool compress = 1;
+
+    /// Parse size=<N>[K|M|G],interval=<N>[s|m|h|d],compress=gzip|none
+    static RotatePolicy parse(const std::string& spec);
+  };
+
+  /// Background thread compressing closed files, so rotating never
+  /// waits on it
+  class Compressor
+  {
+  public:
+    Compressor();
+    Compressor(const Compressor& o) = delete;
+
+    /// Compress whatever is still queued, then join the thread
+    ~Compressor();
+
+    /// Queue a file to be replaced by path.gz
+    void add(const std::string& path);
+
+  private:
+    std::deque<std::string> _queue;
+    std::mutex _lock;
+    std::condition_variable _wake;
+    bool _stopping = 0;
+    std::thread _thread;
+    void _run();
+    void _gzip(const std::string& path);
+  };
+
+  /// Tracks the active file of an output and decides when to rotate
+  /// it. A closed file is renamed to carry the range of read times
+  /// it holds, as name.<first>-<last>.ext with UTC times
+  class Rotator
+  {
+  public:
+    /// Rotate the file at path by policy, handing closed files to
+    /// compressor if it is not NULL
+    Rotator(const std::string& path, const RotatePolicy& policy,
+	    Compressor* compressor);
+
+    /// Note samples going into the active file
+    void saw(const AmmoniaBatch& batch);
+
+    /// Note bytes written to the active file
+    void wrote(size_t bytes) {_bytes += bytes;};
+
+    /// Check if the active file is due to be closed
+    bool due();
+
+    /// Rename the closed active file and queue it for compression.
+    /// The caller then opens a new one at path
+    void rotate();
+
+  private:
+    std::string _path;
+    RotatePolicy _policy;
+    Compressor* _compressor;
+    size_t _bytes = 0;
+    bool _held = 0;
+    long long _first = 0;
+    long long _last = 0;
+    std::chrono::system_clock::time_point _deadline;
+    void _schedule();
+    std::string _segmentName();
+  };
+}
+
+#endif
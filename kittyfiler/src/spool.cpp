@@ -0,0 +1,605 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// spool.cpp
+
+#include "spool.hpp"
+#include "crc.hpp"
+#include "trace.hpp"
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace Filer
+{
+  // Each record is a 32 bit payload length and the CRC-32 of the
+  // payload, then the payload, an encoded AmmoniaBatch
+  static const size_t recordHeader = 8;
+
+  static std::string errorString(const std::string& where,
+				 const std::string& what)
+  {
+    std::string err = "In Filer::Spool::" + where + ": ";
+    err += what + ": ";
+    err += strerror(errno);
+    return err;
+  }
+
+  Spool::Spool(const std::string& dir, size_t maxBytes)
+    :_dir(dir), _maxBytes(maxBytes)
+  {
+    // Keep segments small enough that dropping one to make room
+    // loses only a small part of the spool
+    _segmentBytes = _maxBytes / 8;
+    if (_segmentBytes > (4 << 20)) _segmentBytes = 4 << 20;
+    if (_segmentBytes < (64 << 10)) _segmentBytes = 64 << 10;
+
+    std::filesystem::create_directories(_dir);
+    _recover();
+  }
+
+  Spool::~Spool()
+  {
+    if (_wfd >= 0) close(_wfd);
+    if (_rfd >= 0) close(_rfd);
+  }
+
+  std::string Spool::_path(unsigned long long seq)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llu.seg", seq);
+    return _dir + "/" + name;
+  }
+
+  // Find the segments and checkpoint left by the last run, and cut
+  // off a record torn by a crash part way through a write
+  void Spool::_recover()
+  {
+    for (auto& e : std::filesystem::directory_iterator(_dir))
+      {
+	std::string name = e.path().filename().string();
+	if (e.path().extension() != ".seg") continue;
+	if (name.find_first_not_of("0123456789") != name.size() - 4)
+	  continue;
+	_segments[std::stoull(name)] = e.file_size();
+      }
+
+    std::ifstream cp(_dir + "/checkpoint");
+    if (!(cp >> _cseq >> _coff))
+      {
+	_cseq = 0;
+	_coff = 0;
+      }
+
+    // Segments before the checkpoint were taken but not yet removed
+    while (!_segments.empty() && _segments.begin()->first < _cseq)
+      {
+	unlink(_path(_segments.begin()->first).c_str());
+	_segments.erase(_segments.begin());
+      }
+
+    if (_segments.empty())
+      {
+	_wseq = _cseq > 0 ? _cseq : 1;
+	_cseq = _wseq;
+	_coff = 0;
+	_roll();
+      }
+    else
+      {
+	// The checkpoint's own segment may have been dropped for room
+	if (_segments.begin()->first != _cseq)
+	  {
+	    _cseq = _segments.begin()->first;
+	    _coff = 0;
+	  }
+
+	auto last = std::prev(_segments.end());
+	size_t valid = _validate(last->first, last->second);
+	if (valid < last->second)
+	  {
+	    std::cerr << "Spool: dropping " << last->second - valid
+		      << " torn bytes from " << _path(last->first)
+		      << std::endl;
+	    if (truncate(_path(last->first).c_str(), valid) < 0)
+	      throw std::runtime_error(errorString("_recover",
+						   "Could not truncate segment"));
+	    last->second = valid;
+	  }
+
+	_wseq = last->first;
+	_wfd = open(_path(_wseq).c_str(),
+		    O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (_wfd < 0)
+	  throw std::runtime_error(errorString("_recover",
+					       "Could not open segment"));
+      }
+
+    if (_coff > _segments[_cseq]) _coff = _segments[_cseq];
+
+    _bytes = 0;
+    for (auto& s : _segments) _bytes += s.second;
+    _rseq = _cseq;
+    _roff = _coff;
+  }
+
+  // Return the length of the run of whole, intact records at the
+  // start of a segment
+  size_t Spool::_validate(unsigned long long seq, size_t size)
+  {
+    int fd = open(_path(seq).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw std::runtime_error(errorString("_validate",
+					   "Could not open segment"));
+
+    size_t off = 0;
+    std::string payload;
+
+    while (off + recordHeader <= size)
+      {
+	uint32_t head[2];
+	if (pread(fd, head, recordHeader, off) != recordHeader) break;
+	if (head[0] > size - off - recordHeader) break;
+
+	payload.resize(head[0]);
+	if (pread(fd, &payload[0], head[0], off + recordHeader)
+	    != static_cast<ssize_t>(head[0]))
+	  break;
+	if (crc32(payload.data(), payload.size()) != head[1]) break;
+
+	off += recordHeader + head[0];
+      }
+
+    close(fd);
+    return off;
+  }
+
+  // Start a new segment after the current one
+  void Spool::_roll()
+  {
+    if (_wfd >= 0)
+      {
+	close(_wfd);
+	_wseq++;
+      }
+
+    _wfd = open(_path(_wseq).c_str(),
+		O_WRONLY | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (_wfd < 0)
+      throw std::runtime_error(errorString("_roll",
+					   "Could not create segment"));
+
+    _segments[_wseq] = 0;
+    _syncDir();
+  }
+
+  // Remove a whole segment, moving the read position and checkpoint
+  // past it if they were inside
+  void Spool::_drop(unsigned long long seq)
+  {
+    auto it = _segments.find(seq);
+    if (it == _segments.end() || seq == _wseq) return;
+
+    auto next = std::next(it);
+    if (_cseq == seq)
+      {
+	_lost += it->second - _coff;
+	_cseq = next->first;
+	_coff = 0;
+      }
+    if (_rseq == seq)
+      {
+	_rseq = next->first;
+	_roff = 0;
+      }
+    if (_rfdseq == seq && _rfd >= 0)
+      {
+	close(_rfd);
+	_rfd = -1;
+      }
+
+    _bytes -= it->second;
+    _segments.erase(it);
+    _checkpoint();
+    unlink(_path(seq).c_str());
+  }
+
+  // Replace the checkpoint so a crash leaves either the old or the
+  // new one, never a mix
+  void Spool::_checkpoint()
+  {
+    std::string tmp = _dir + "/checkpoint.tmp";
+    char line[64];
+    int n = snprintf(line, sizeof(line), "%llu %zu\n", _cseq, _coff);
+
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		  0644);
+    if (fd < 0)
+      throw std::runtime_error(errorString("_checkpoint",
+					   "Could not create checkpoint"));
+
+    if (::write(fd, line, n) != n || fsync(fd) < 0)
+      {
+	std::string err = errorString("_checkpoint",
+				      "Could not write checkpoint");
+	close(fd);
+	throw std::runtime_error(err);
+      }
+
+    close(fd);
+
+    if (rename(tmp.c_str(), (_dir + "/checkpoint").c_str()) < 0)
+      throw std::runtime_error(errorString("_checkpoint",
+					   "Could not replace checkpoint"));
+    _syncDir();
+  }
+
+  void Spool::_syncDir()
+  {
+    int fd = open(_dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+  }
+
+  void Spool::write(const AmmoniaBatch& batch)
+  {
+    TraceSpan span("spool write", "rows", batch.size());
+    std::string rec(recordHeader, '\0');
+    batch.encode(rec);
+
+    uint32_t head[2];
+    head[0] = rec.size() - recordHeader;
+    head[1] = crc32(rec.data() + recordHeader, head[0]);
+    memcpy(&rec[0], head, recordHeader);
+
+    std::lock_guard<std::mutex> guard(_lock);
+
+    if (_segments[_wseq] > 0
+	&& _segments[_wseq] + rec.size() > _segmentBytes)
+      _roll();
+
+    // Make room by giving up the oldest samples first
+    while (_bytes + rec.size() > _maxBytes && _segments.size() > 1)
+      {
+	std::cerr << "Spool: full, dropping "
+		  << _path(_segments.begin()->first) << std::endl;
+	_drop(_segments.begin()->first);
+      }
+
+    size_t done = 0;
+    while (done < rec.size())
+      {
+	ssize_t n = ::write(_wfd, rec.data() + done, rec.size() - done);
+	if (n < 0 && errno == EINTR) continue;
+	if (n < 0)
+	  {
+	    // Cut off the partial record so the segment stays readable
+	    std::string err = errorString("write", "Could not write record");
+	    if (ftruncate(_wfd, _segments[_wseq]) < 0) _roll();
+	    throw std::runtime_error(err);
+	  }
+	done += n;
+      }
+
+    if (fsync(_wfd) < 0)
+      throw std::runtime_error(errorString("write",
+					   "Could not sync segment"));
+
+    _segments[_wseq] += rec.size();
+    _bytes += rec.size();
+  }
+
+  size_t Spool::read(AmmoniaBatch& out, size_t maxRows)
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    size_t start = out.size();
+    std::string payload;
+
+    while (out.size() - start < maxRows)
+      {
+	auto it = _segments.find(_rseq);
+	if (it == _segments.end()) break;
+
+	if (_roff >= it->second)
+	  {
+	    if (_rseq == _wseq) break;
+	    _rseq = std::next(it)->first;
+	    _roff = 0;
+	    continue;
+	  }
+
+	if (_rfdseq != _rseq || _rfd < 0)
+	  {
+	    if (_rfd >= 0) close(_rfd);
+	    _rfd = open(_path(_rseq).c_str(), O_RDONLY | O_CLOEXEC);
+	    _rfdseq = _rseq;
+	    if (_rfd < 0)
+	      throw std::runtime_error(errorString("read",
+						   "Could not open segment"));
+	  }
+
+	uint32_t head[2];
+	bool good = pread(_rfd, head, recordHeader, _roff) == recordHeader
+	  && head[0] <= it->second - _roff - recordHeader;
+
+	if (good)
+	  {
+	    payload.resize(head[0]);
+	    good = pread(_rfd, &payload[0], head[0], _roff + recordHeader)
+	      == static_cast<ssize_t>(head[0])
+	      && crc32(payload.data(), payload.size()) == head[1]
+	      && out.decode(payload);
+	  }
+
+	// Nothing after a bad record can be trusted to line up, so
+	// skip the rest of the segment
+	if (!good)
+	  {
+	    std::cerr << "Spool: corrupt record in " << _path(_rseq)
+		      << " at " << _roff << ", skipping rest of segment"
+		      << std::endl;
+	    _lost += it->second - _roff;
+	    _roff = it->second;
+	    continue;
+	  }
+
+	_roff += recordHeader + head[0];
+      }
+
+    return out.size() - start;
+  }
+
+  void Spool::commit()
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (_rseq == _cseq && _roff == _coff) return;
+
+    _cseq = _rseq;
+    _coff = _roff;
+
+    while (_segments.begin()->first < _cseq)
+      {
+	_bytes -= _segments.begin()->second;
+	if (_rfdseq == _segments.begin()->first && _rfd >= 0)
+	  {
+	    close(_rfd);
+	    _rfd = -1;
+	  }
+	unlink(_path(_segments.begin()->first).c_str());
+	_segments.erase(_segments.begin());
+      }
+
+    // Everything has been taken, so start over on a fresh segment
+    // rather than let the last one grow
+    if (_cseq == _wseq && _coff == _segments[_wseq])
+      {
+	unsigned long long old = _wseq;
+	_roll();
+	_cseq = _rseq = _wseq;
+	_coff = _roff = 0;
+	_drop(old);
+	return;
+      }
+
+    _checkpoint();
+  }
+
+  void Spool::rewind()
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _rseq = _cseq;
+    _roff = _coff;
+  }
+
+  bool Spool::empty()
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _cseq == _wseq && _coff >= _segments[_wseq];
+  }
+
+  size_t Spool::bytes()
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _bytes;
+  }
+
+  unsigned long long Spool::lost()
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _lost;
+  }
+
+  SpoolReplayer::SpoolReplayer(Spool& spool,
+			       std::function<void(const AmmoniaBatch&)> send,
+			       size_t rows)
+    :_spool(spool), _send(send), _rows(rows)
+  {
+  }
+
+  SpoolReplayer::~SpoolReplayer()
+  {
+    stop();
+  }
+
+  void SpoolReplayer::start()
+  {
+    _stopping = 0;
+    _thread = std::thread(&SpoolReplayer::_run, this);
+  }
+
+  void SpoolReplayer::stop()
+  {
+    {
+      std::lock_guard<std::mutex> guard(_wakeLock);
+      _stopping = 1;
+    }
+    _wake.notify_all();
+
+    if (_thread.joinable()) _thread.join();
+  }
+
+  void SpoolReplayer::_sleep(unsigned ms)
+  {
+    std::unique_lock<std::mutex> guard(_wakeLock);
+    _wake.wait_for(guard, std::chrono::milliseconds(ms),
+		   [this] {return _stopping.load();});
+  }
+
+  void SpoolReplayer::_run()
+  {
+    unsigned backoff = 0;
+    // After a rejected batch, send one record at a time to find and
+    // skip the bad one without losing its neighbours
+    bool isolate = 0;
+    unsigned sinceReject = 0;
+    AmmoniaBatch batch;
+
+    Trace::nameThread("spool replay");
+
+    while (!_stopping)
+      {
+	if (backoff > 0) _sleep(backoff);
+	if (_stopping) break;
+
+	batch.clear();
+	if (_spool.read(batch, isolate ? 1 : _rows) == 0)
+	  {
+	    // Save any corrupt records skipped over
+	    _spool.commit();
+	    _sleep(1000);
+	    continue;
+	  }
+
+	try
+	  {
+	    TraceSpan span("spool replay", "rows", batch.size());
+	    _send(batch);
+	    _spool.commit();
+	    _replayed += batch.size();
+
+	    if (backoff > 0)
+	      std::cerr << "Spool: database is back, replaying" << std::endl;
+	    backoff = 0;
+
+	    if (isolate && ++sinceReject >= 64) isolate = 0;
+	  }
+	catch (SpoolRejected& e)
+	  {
+	    if (!isolate)
+	      {
+		_spool.rewind();
+	      }
+	    else if (_sendRows(batch, e))
+	      {
+		_spool.commit();
+	      }
+	    else
+	      {
+		// Sent again from the start once the database is back,
+		// the rows already stored turned away by its key
+		_spool.rewind();
+		backoff = 1000;
+	      }
+
+	    isolate = 1;
+	    sinceReject = 0;
+	  }
+	catch (std::exception& e)
+	  {
+	    _spool.rewind();
+
+	    if (backoff == 0)
+	      std::cerr << "Spool: replay failed, retrying: "
+			<< e.what() << std::endl;
+	    backoff = backoff == 0 ? 1000 : backoff * 2;
+	    if (backoff > 60000) backoff = 60000;
+	  }
+      }
+  }
+
+  // A record refused on its own may be a whole group commit or
+  // pipelined batch, so send it a sample at a time and skip only the
+  // samples refused by themselves. Returns false if the database
+  // failed some other way part way through
+  bool SpoolReplayer::_sendRows(const AmmoniaBatch& batch,
+				const SpoolRejected& e)
+  {
+    if (batch.size() == 1)
+      {
+	std::cerr << "Spool: skipping a sample the database refused: "
+		  << e.what() << std::endl;
+	_rejected++;
+	return 1;
+      }
+
+    AmmoniaBatch row;
+    for (size_t i = 0; i < batch.size(); i++)
+      {
+	row.clear();
+	row.append(batch, i, 1);
+
+	try
+	  {
+	    _send(row);
+	    _replayed++;
+	  }
+	catch (SpoolRejected& r)
+	  {
+	    std::cerr << "Spool: skipping a sample the database refused: "
+		      << r.what() << std::endl;
+	    row.writeCSV(std::cerr, 1);
+	    _rejected++;
+	  }
+	catch (std::exception& r)
+	  {
+	    std::cerr << "Spool: replay failed, retrying: " << r.what()
+		      << std::endl;
+	    return 0;
+	  }
+      }
+
+    return 1;
+  }
+}
@@ -0,0 +1,164 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// spool.hpp
+
+#include "batch.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#ifndef spool_hpp
+#define spool_hpp
+
+namespace Filer
+{
+  /// Append-only store on local disk for samples the database could
+  /// not take yet. Samples go into numbered segment files as records
+  /// with a length and CRC, and a checkpoint file, replaced by rename,
+  /// records how far the database has taken them
+  class Spool
+  {
+  public:
+    /// Open or create the spool in directory dir, using at most
+    /// maxBytes of disk before the oldest samples are thrown away
+    Spool(const std::string& dir, size_t maxBytes = 256 << 20);
+    Spool(const Spool& o) = delete;
+    ~Spool();
+
+    /// Durably append a batch. Returns once it is on disk
+    void write(const AmmoniaBatch& batch);
+
+    /// Append records after the read position to out until at least
+    /// maxRows samples are held, return the samples added
+    size_t read(AmmoniaBatch& out, size_t maxRows);
+
+    /// Mark everything read so far as stored in the database
+    void commit();
+
+    /// Go back to the checkpoint so uncommitted records are read again
+    void rewind();
+
+    /// Check if every record has been committed
+    bool empty();
+
+    /// Bytes of disk held by segments
+    size_t bytes();
+
+    /// Bytes thrown away to stay under the limit or found corrupt
+    unsigned long long lost();
+
+    const std::string& dir() {return _dir;};
+
+  private:
+    std::string _dir;
+    size_t _maxBytes;
+    size_t _segmentBytes;
+    std::mutex _lock;
+    /// Size of every segment on disk, by sequence number
+    std::map<unsigned long long, size_t> _segments;
+    size_t _bytes = 0;
+    unsigned long long _lost = 0;
+    int _wfd = -1;
+    unsigned long long _wseq = 0;
+    int _rfd = -1;
+    unsigned long long _rfdseq = 0;
+    unsigned long long _cseq = 0;
+    size_t _coff = 0;
+    unsigned long long _rseq = 0;
+    size_t _roff = 0;
+    std::string _path(unsigned long long seq);
+    void _recover();
+    size_t _validate(unsigned long long seq, size_t size);
+    void _roll();
+    void _drop(unsigned long long seq);
+    void _checkpoint();
+    void _syncDir();
+  };
+
+  /// Thrown by a replay function when the database is reachable but
+  /// refused the samples, so sending them again would not help
+  class SpoolRejected : public std::runtime_error
+  {
+  public:
+    using std::runtime_error::runtime_error;
+  };
+
+  /// Background thread sending spooled samples on in large batches
+  /// whenever the database will take them
+  class SpoolReplayer
+  {
+  public:
+    /// Drain spool through send, at most rows samples at a time.
+    /// send throws when the samples were not stored
+    SpoolReplayer(Spool& spool,
+		  std::function<void(const AmmoniaBatch&)> send,
+		  size_t rows = 5000);
+    SpoolReplayer(const SpoolReplayer& o) = delete;
+    ~SpoolReplayer();
+
+    void start();
+
+    /// Finish the batch being sent, then join the thread. What is
+    /// left stays in the spool for next time
+    void stop();
+
+    unsigned long long replayed() {return _replayed;};
+    unsigned long long rejected() {return _rejected;};
+
+  private:
+    Spool& _spool;
+    std::function<void(const AmmoniaBatch&)> _send;
+    size_t _rows;
+    std::thread _thread;
+    std::mutex _wakeLock;
+    std::condition_variable _wake;
+    std::atomic<bool> _stopping{0};
+    std::atomic<unsigned long long> _replayed{0};
+    std::atomic<unsigned long long> _rejected{0};
+    void _sleep(unsigned ms);
+    bool _sendRows(const AmmoniaBatch& batch, const SpoolRejected& e);
+    void _run();
+  };
+}
+
+#endif
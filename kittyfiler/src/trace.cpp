@@ -0,0 +1,190 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// trace.cpp
+
+#include "trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <unistd.h>
+#include <json/json.h>
+
+namespace Filer
+{
+  struct TraceEvent
+  {
+    std::string_view name;
+    int64_t start;
+    int64_t end;
+    const char* argName;
+    long long arg;
+  };
+
+  /// The spans of one thread. Only that thread writes to it
+  struct TraceRing
+  {
+    std::string thread;
+    int tid;
+    std::vector<TraceEvent> events;
+    std::atomic<uint64_t> next{0};
+  };
+
+  std::atomic<bool> Trace::_enabled{0};
+
+  // Rings are never freed, so spans of finished threads can still be
+  // written out
+  static std::mutex ringsLock;
+  static std::vector<TraceRing*> rings;
+  static size_t ringSize = 0;
+  static thread_local TraceRing* ring = NULL;
+
+  static TraceRing* threadRing()
+  {
+    if (ring) return ring;
+
+    std::lock_guard<std::mutex> guard(ringsLock);
+    ring = new TraceRing;
+    ring->tid = rings.size() + 1;
+    ring->thread = "thread " + std::to_string(ring->tid);
+    ring->events.resize(ringSize);
+    rings.push_back(ring);
+    return ring;
+  }
+
+  void Trace::enable(size_t perThread)
+  {
+    {
+      std::lock_guard<std::mutex> guard(ringsLock);
+      ringSize = perThread > 0 ? perThread : 1;
+    }
+    _enabled.store(1);
+  }
+
+  void Trace::nameThread(const std::string& name)
+  {
+    if (!enabled()) return;
+
+    TraceRing* r = threadRing();
+    std::lock_guard<std::mutex> guard(ringsLock);
+    r->thread = name;
+  }
+
+  int64_t Trace::now()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>
+      (std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void Trace::record(std::string_view name, int64_t start, int64_t end,
+		     const char* argName, long long arg)
+  {
+    TraceRing* r = threadRing();
+    uint64_t n = r->next.load(std::memory_order_relaxed);
+
+    r->events[n % r->events.size()] = {name, start, end, argName, arg};
+    r->next.store(n + 1, std::memory_order_release);
+  }
+
+  void Trace::write(std::ostream& out)
+  {
+    std::lock_guard<std::mutex> guard(ringsLock);
+    int pid = getpid();
+    int64_t base = INT64_MAX;
+    bool first = 1;
+    char num[64];
+
+    // Times are written from the first span kept, in microseconds
+    for (auto it = rings.begin(); it != rings.end(); it++)
+      {
+	TraceRing& r = **it;
+	uint64_t n = r.next.load(std::memory_order_acquire);
+	uint64_t from = n > r.events.size() ? n - r.events.size() : 0;
+	for (uint64_t i = from; i < n; i++)
+	  base = std::min(base, r.events[i % r.events.size()].start);
+      }
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+    for (auto it = rings.begin(); it != rings.end(); it++)
+      {
+	TraceRing& r = **it;
+	uint64_t n = r.next.load(std::memory_order_acquire);
+	uint64_t from = n > r.events.size() ? n - r.events.size() : 0;
+
+	out << (first ? "" : ",") << "\n{\"name\":\"thread_name\","
+	    << "\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << r.tid
+	    << ",\"args\":{\"name\":"
+	    << Json::valueToQuotedString(r.thread.c_str()) << "}}";
+	first = 0;
+
+	for (uint64_t i = from; i < n; i++)
+	  {
+	    TraceEvent& e = r.events[i % r.events.size()];
+	    std::string name(e.name);
+
+	    snprintf(num, sizeof(num), "\"ts\":%.3f,\"dur\":%.3f",
+		     (e.start - base) / 1e3, (e.end - e.start) / 1e3);
+	    out << ",\n{\"name\":" << Json::valueToQuotedString(name.c_str())
+		<< ",\"cat\":\"kittyfiler\",\"ph\":\"X\"," << num
+		<< ",\"pid\":" << pid << ",\"tid\":" << r.tid;
+	    if (e.argName)
+	      out << ",\"args\":{\"" << e.argName << "\":" << e.arg << "}";
+	    out << "}";
+	  }
+      }
+
+    out << "\n]}" << std::endl;
+  }
+
+  void Trace::dump(const std::string& path)
+  {
+    std::ofstream out(path);
+    write(out);
+
+    if (!out)
+      {
+	std::string err = "In Filer::Trace::dump: Could not write ";
+	err += path;
+	throw std::runtime_error(err);
+      }
+  }
+}
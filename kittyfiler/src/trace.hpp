@@ -0,0 +1,117 @@
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// +                                                                +
+// +                           KITTYFILER                           +
+// +                 A program to file cat data into                +
+// +                      a Postgresql database                     +
+// +                                                                +
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+// Copyright 2021 Tyler J. Anderson
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+
+// 3. Neither the name of the copyright holder nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// trace.hpp
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#ifndef trace_hpp
+#define trace_hpp
+
+namespace Filer
+{
+  /// Records begin and end of spans into a ring buffer per thread and
+  /// writes them as Chrome trace event JSON, which Perfetto and
+  /// chrome://tracing load. While disabled a span costs one relaxed
+  /// load
+  class Trace
+  {
+  public:
+    /// Start recording, keeping the last perThread spans of each thread
+    static void enable(size_t perThread = 65536);
+
+    static bool enabled()
+    {return _enabled.load(std::memory_order_relaxed);};
+
+    /// Name the calling thread in the trace
+    static void nameThread(const std::string& name);
+
+    /// Steady clock nanoseconds
+    static int64_t now();
+
+    /// Add a finished span on the calling thread. name must outlive
+    /// the trace, such as a literal or an interned string
+    static void record(std::string_view name, int64_t start, int64_t end,
+		       const char* argName = NULL, long long arg = 0);
+
+    /// Write every recorded span as Chrome trace event JSON. Call
+    /// once the threads being traced are stopped
+    static void write(std::ostream& out);
+
+    /// Write the trace to path
+    static void dump(const std::string& path);
+
+  private:
+    static std::atomic<bool> _enabled;
+  };
+
+  /// Records a span from construction to destruction while tracing
+  /// is enabled
+  class TraceSpan
+  {
+  public:
+    explicit TraceSpan(std::string_view name, const char* argName = NULL,
+		       long long arg = 0)
+      : _name(name), _argName(argName), _arg(arg),
+	_start(Trace::enabled() ? Trace::now() : -1) {};
+
+    ~TraceSpan()
+    {
+      if (_start >= 0)
+	Trace::record(_name, _start, Trace::now(), _argName, _arg);
+    };
+
+    /// Attach a number to the span, such as rows written
+    void arg(const char* name, long long value)
+    {
+      _argName = name;
+      _arg = value;
+    };
+
+  private:
+    std::string_view _name;
+    const char* _argName;
+    long long _arg;
+    int64_t _start;
+  };
+}
+
+#endif